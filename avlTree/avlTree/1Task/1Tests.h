@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <vector>
 
@@ -190,6 +192,168 @@ void ConsitencyPPPPMM()
     
 }
 
+void TestHintedInsert()
+{
+    avl_tree<int, int> tree;
+    for (int i = 0; i < 1000; i++) {
+        auto it = tree.insert(tree.end(), i, i * 2);
+        ASSERT_EQUAL(it.key(), i);
+    }
+    
+    int expected = 0;
+    for (auto it = tree.begin(); it != tree.end(); it++) {
+        ASSERT_EQUAL(it.key(), expected);
+        ASSERT_EQUAL(*it, expected * 2);
+        expected++;
+    }
+    ASSERT_EQUAL(expected, 1000);
+    ASSERT_EQUAL(*tree.find(777), 1554);
+}
+
+void TestAppendMixed()
+{
+    avl_tree<int, int> tree;
+    for (int i = 10; i < 20; i++) {
+        tree.append(i, i);
+    }
+    tree.insert(5, 5);
+    tree.remove(19);
+    tree.append(30, 30);
+    tree.append(1, 1);
+    tree.insert(tree.find(30), 25, 25);
+    tree.insert(40, 40);
+    
+    ostringstream os;
+    for (auto it = tree.begin(); it != tree.end(); it++) {
+        os << it.key() << " ";
+    }
+    ASSERT_EQUAL(os.str(), "1 5 10 11 12 13 14 15 16 17 18 25 30 40 ");
+}
+
+void TestExtremes()
+{
+    avl_tree<int, string> tree;
+    ASSERT_EQUAL(tree.begin() == tree.end(), true);
+    
+    tree.insert(5, "5");
+    tree.insert(3, "3");
+    tree.insert(8, "8");
+    tree.insert(1, "1");
+    ASSERT_EQUAL(tree.min().key(), 1);
+    ASSERT_EQUAL(tree.max().key(), 8);
+    
+    tree.remove(1);
+    tree.remove(8);
+    ASSERT_EQUAL(tree.begin().key(), 3);
+    ASSERT_EQUAL(tree.rbegin().key(), 5);
+    
+    auto it = tree.rbegin();
+    it--;
+    ASSERT_EQUAL(*it, "3");
+    it--;
+    ASSERT_EQUAL(it == tree.rend(), true);
+    
+    tree.remove(3);
+    tree.remove(5);
+    ASSERT_EQUAL(tree.begin() == tree.end(), true);
+}
+
+// counts the values alive, so a teardown that drops nodes shows up
+struct Tracked
+{
+    static int alive;
+    int v;
+    Tracked(int v = 0) : v(v) { alive++; }
+    Tracked(const Tracked& other) : v(other.v) { alive++; }
+    Tracked& operator=(const Tracked&) = default;
+    ~Tracked() { alive--; }
+};
+int Tracked::alive = 0;
+
+/*
+ An AVL tree of n nodes is only about 1.44 log2 n deep, so no tree built
+ here gets deep enough to overflow a recursive teardown. What this checks
+ is that clear() and the destructor release every node.
+*/
+void TestClearLarge()
+{
+    {
+        avl_tree<int, Tracked> tree;
+        // the head node holds a value of its own
+        int head = Tracked::alive;
+        for (int i = 0; i < 100000; i++) {
+            tree.append(i, Tracked(i));
+        }
+        ASSERT_EQUAL(Tracked::alive, head + 100000);
+        tree.clear();
+        ASSERT_EQUAL(Tracked::alive, head);
+        ASSERT_EQUAL(tree.empty(), true);
+        ASSERT_EQUAL(tree.begin() == tree.end(), true);
+        
+        tree.insert(1, Tracked(1));
+        ASSERT_EQUAL((*tree.begin()).v, 1);
+        for (int i = 2; i < 1000; i++) {
+            tree.insert(i, Tracked(i));
+        }
+    }
+    ASSERT_EQUAL(Tracked::alive, 0);
+}
+
+void TestNodeSize()
+{
+    cout << "avl_tree<int, int> node: " << avl_tree<int, int>::node_size() << endl;
+    cout << "avl_tree<int, string> node: " << avl_tree<int, string>::node_size() << endl;
+    
+    // what a node has to hold anyway; height and the deleted flag may add one alignment unit at most
+    struct payload_int { int key; int value; SmartPointer<int> left; SmartPointer<int> right; };
+    struct payload_char { char key; char value; SmartPointer<int> left; SmartPointer<int> right; };
+    ASSERT_EQUAL((avl_tree<int, int>::node_size()) <= sizeof(payload_int) + alignof(payload_int), true);
+    ASSERT_EQUAL((avl_tree<char, char>::node_size()) <= sizeof(payload_char) + alignof(payload_char), true);
+}
+
+void TestParallelAlgorithms()
+{
+    avl_tree<int, int> tree;
+    int elNum = 100000;
+    for (int i = 0; i < elNum; i++) {
+        tree.append(i, i);
+    }
+    
+    atomic<long long> sum(0);
+    tree.parallel_for_each([&sum](int key, int value) { sum += key + value; }, 4);
+    ASSERT_EQUAL(sum.load(), (long long)elNum * (elNum - 1));
+    
+    long long total = tree.parallel_reduce(0LL, [](int, int value) { return (long long)value; },
+                                           [](long long a, long long b) { return a + b; }, 4);
+    ASSERT_EQUAL(total, (long long)elNum * (elNum - 1) / 2);
+    
+    tree.parallel_transform_values([](int key, int value) { return key + 2 * value; }, 3);
+    int expected = 0;
+    for (auto it = tree.begin(); it != tree.end(); ++it, expected++) {
+        ASSERT_EQUAL(it.value(), 3 * expected);
+    }
+    ASSERT_EQUAL(expected, elNum);
+    
+    // concatenation is not commutative, so the shares must be joined in key order
+    avl_tree<int, int> small;
+    for (int i = 0; i < 1000; i++) {
+        small.insert((i * 389) % 1000, i);
+    }
+    auto concat = [](vector<int> a, const vector<int>& b) {
+        a.insert(a.end(), b.begin(), b.end());
+        return a;
+    };
+    for (unsigned th = 1; th <= 5; th++) {
+        vector<int> keys = small.parallel_reduce(vector<int>(), [](int key, int) { return vector<int>(1, key); },
+                                                 concat, th);
+        ASSERT_EQUAL(keys.size(), 1000U);
+        ASSERT_EQUAL(is_sorted(keys.begin(), keys.end()), true);
+    }
+    
+    avl_tree<int, int> empty;
+    ASSERT_EQUAL(empty.parallel_reduce(7, [](int, int value) { return value; }, [](int a, int b) { return a + b; }), 7);
+}
+
 void Test(){
     TestRunner tr;
     
@@ -207,4 +371,10 @@ void Test(){
     RUN_TEST(tr, TestKeyAndValFunc);
     RUN_TEST(tr, ConsitencyOnlyPP);
     RUN_TEST(tr, ConsitencyPPPPMM);
+    RUN_TEST(tr, TestExtremes);
+    RUN_TEST(tr, TestClearLarge);
+    RUN_TEST(tr, TestNodeSize);
+    RUN_TEST(tr, TestHintedInsert);
+    RUN_TEST(tr, TestAppendMixed);
+    RUN_TEST(tr, TestParallelAlgorithms);
 }
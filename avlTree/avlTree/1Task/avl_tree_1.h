@@ -1,6 +1,11 @@
 #pragma once
 #include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
 #include "smart_pointer.h"
+#include "avl_height.h"
+#include "parallel_subtrees.h"
 
 using smart_pointer::SmartPointer;
 
@@ -12,10 +17,10 @@ class avl_tree
     {
         key_type _key;
         value_type _value;
-        unsigned int _height;
         SmartPointer<node> _left;
         SmartPointer<node> _right;
-        bool deleted;
+        std::uint8_t _height : avl_height_bits;
+        std::uint8_t deleted : 1;
         
         node(key_type key, value_type value)
         {
@@ -30,9 +35,15 @@ class avl_tree
     using nodepntr = SmartPointer<node>;
     nodepntr _tree;
     size_t _size;
+    // right spine from the root down to the maximum, empty while it is stale
+    std::vector<nodepntr> _spine;
+    // leftmost and rightmost nodes, null for an empty tree
+    nodepntr _min;
+    nodepntr _max;
     
     typedef class Iterator
     {
+        friend avl_tree;
         nodepntr _node;
         nodepntr _tree;
         
@@ -48,7 +59,7 @@ class avl_tree
         
         bool operator==(const Iterator& rhs)
         {
-            return _node == !rhs._node;
+            return _node == rhs._node;
             
         }
         
@@ -178,12 +189,33 @@ public:
     
     Iterator begin()
     {
-        return Iterator(findMin(_tree -> _left), _tree);
+        return Iterator(_min, _tree);
     }
     
     Iterator begin() const
     {
-        return Iterator(findMin(_tree -> _left), _tree);
+        return Iterator(_min, _tree);
+    }
+    
+    // last element, walk it with operator--
+    Iterator rbegin()
+    {
+        return Iterator(_max, _tree);
+    }
+    
+    Iterator rend()
+    {
+        return end();
+    }
+    
+    Iterator min()
+    {
+        return begin();
+    }
+    
+    Iterator max()
+    {
+        return rbegin();
     }
     
     Iterator end()
@@ -201,23 +233,76 @@ public:
         return _size == static_cast<size_t>(0);
     }
     
+    // memory taken by one element of the tree, without allocator overhead
+    static constexpr size_t node_size()
+    {
+        return sizeof(node);
+    }
+    
     void clear()
     {
         _size = 0U;
+        _spine.clear();
+        _min = _max = nullptr;
+        _destroy(_tree -> _left);
         _tree -> _left = NULL;
     }
     
     Iterator insert(const key_type& key, const value_type& value)
     {
+        if (_max && key > _max -> _key){
+            return _append(key, value);
+        }
+        
+        _spine.clear();
         _tree -> _left = _insert(_tree -> _left, key, value);
         _size++;
-        return Iterator(_find(_tree -> _left, key), _tree);
+        
+        nodepntr nd = _find(_tree -> _left, key);
+        if (!_min || key < _min -> _key){
+            _min = nd;
+        }
+        if (!_max){
+            _max = nd;
+        }
+        return Iterator(nd, _tree);
+    }
+    
+    /*
+     hint is the position the new element goes before; end() or the last
+     element make an append of a key above the maximum amortized O(1),
+     any other hint falls back to the usual descent
+    */
+    Iterator insert(Iterator hint, const key_type& key, const value_type& value)
+    {
+        if (_max && (!hint._node || hint._node -> _key > key) && key > _max -> _key){
+            return _append(key, value);
+        }
+        return insert(key, value);
+    }
+    
+    // fast path for keys larger than the current maximum
+    Iterator append(const key_type& key, const value_type& value)
+    {
+        return insert(end(), key, value);
     }
     
     void remove(const key_type& key)
     {
+        _spine.clear();
         _tree -> _left = _remove(_tree -> _left, key);
         _size--;
+        
+        if (!_tree -> _left){
+            _min = _max = nullptr;
+            return;
+        }
+        if (_min && key == _min -> _key){
+            _min = findMin(_tree -> _left);
+        }
+        if (_max && key == _max -> _key){
+            _max = findMax(_tree -> _left);
+        }
     }
     
     Iterator find(const key_type& key)
@@ -240,12 +325,71 @@ public:
         return res.value();
     }
     
+    /*
+     Parallel algorithms: the tree is cut at its top levels and the
+     subtrees go to up to threads threads. f and map run on several
+     threads at once, and the tree must not change meanwhile.
+    */
+    template<typename Func>
+    void parallel_for_each(Func f, unsigned threads = std::thread::hardware_concurrency())
+    {
+        parallel_subtrees::for_each(_tree -> _left.peek(), threads, [&f](node* n){
+            f(static_cast<const key_type&>(n -> _key), static_cast<const value_type&>(n -> _value));
+        });
+    }
+    
+    // map(key, value) of every element, joined in key order by an associative combine
+    template<typename T, typename Map, typename Combine>
+    T parallel_reduce(T init, Map map, Combine combine, unsigned threads = std::thread::hardware_concurrency())
+    {
+        return parallel_subtrees::reduce(_tree -> _left.peek(), threads, init, [&map](node* n){
+            return map(static_cast<const key_type&>(n -> _key), static_cast<const value_type&>(n -> _value));
+        }, combine);
+    }
+    
+    // value = f(key, value) for every element
+    template<typename Func>
+    void parallel_transform_values(Func f, unsigned threads = std::thread::hardware_concurrency())
+    {
+        parallel_subtrees::for_each(_tree -> _left.peek(), threads, [&f](node* n){
+            n -> _value = f(static_cast<const key_type&>(n -> _key), n -> _value);
+        });
+    }
+    
     ~avl_tree(){
         clear();
     }
     
 private:
     
+    /*
+     drops a subtree without recursion: every node is unlinked from its
+     children before it is released
+    */
+    void _destroy(nodepntr root)
+    {
+        std::vector<nodepntr> stack;
+        
+        if (root){
+            stack.push_back(std::move(root));
+        }
+        
+        while (!stack.empty()){
+            nodepntr nd = std::move(stack.back());
+            stack.pop_back();
+            
+            if (nd -> _left){
+                stack.push_back(nd -> _left);
+            }
+            if (nd -> _right){
+                stack.push_back(nd -> _right);
+            }
+            // nd goes at the end of this pass and takes no children along
+            nd -> _left = nullptr;
+            nd -> _right = nullptr;
+        }
+    }
+    
     unsigned int height(nodepntr _node)
     {
         return _node ? _node -> _height : 0;
@@ -320,6 +464,50 @@ private:
         return balance(_node);
     }
     
+    /*
+     links the node below the maximum and rebalances bottom-up along the
+     cached spine; stops as soon as a height does not change or after the
+     single left rotation that an append can need
+    */
+    Iterator _append(const key_type& key, const value_type& value)
+    {
+        if (_spine.empty()){
+            for (nodepntr q = _tree -> _left; q; q = q -> _right){
+                _spine.push_back(q);
+            }
+        }
+        
+        nodepntr nd(new node(key, value));
+        _max = nd;
+        _spine.back() -> _right = nd;
+        _spine.push_back(nd);
+        _size++;
+        
+        for (size_t i = _spine.size() - 1; i-- > 0; ){
+            nodepntr cur = _spine[i];
+            unsigned int old_height = cur -> _height;
+            nodepntr res = balance(cur);
+            
+            if (res != cur){
+                // the right child took the place of cur on the spine
+                _spine.erase(_spine.begin() + i);
+                if (i == 0){
+                    _tree -> _left = res;
+                }
+                else{
+                    _spine[i - 1] -> _right = res;
+                }
+                break;
+            }
+            
+            if (cur -> _height == old_height){
+                break;
+            }
+        }
+        
+        return Iterator(nd, _tree);
+    }
+    
     nodepntr findMin(nodepntr _node)
     {
         return _node -> _left ? findMin(_node -> _left) : _node;
@@ -1,12 +1,21 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <map>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "test_runner.h"
 #include "avl_tree.h"
+#include "bravo_rw_lock.h"
+#include "flat_combining_tree.h"
+#include "sharded_avl_map.h"
+#include "rcu_avl_tree.h"
+#include "instrumented_lock.h"
 
 using namespace std;
 
@@ -103,9 +112,730 @@ void AtomacityTestErase()
     ASSERT_EQUAL(tree.empty(), true);
 }
 
+void ExtremesTest()
+{
+    avl_tree<int, int> tree;
+    vector<thread> ths;
+    
+    for (int i = 0; i < 4; i++) {
+        ths.push_back(thread([&tree](int th) {
+            for (int j = 0; j < 100; j++) {
+                tree.insert(j * 4 + th, j);
+            }
+        }, i));
+    }
+    for (auto& i : ths) {
+        i.join();
+    }
+    
+    ASSERT_EQUAL(tree.min().key(), 0);
+    ASSERT_EQUAL(tree.max().key(), 399);
+    tree.remove(0);
+    tree.remove(399);
+    ASSERT_EQUAL(tree.begin().key(), 1);
+    ASSERT_EQUAL(tree.rbegin().key(), 398);
+}
+
+void ScanTest()
+{
+    avl_tree<int, int> tree;
+    for (int i = 0; i < 100; i++) {
+        tree.insert(i, i * i);
+    }
+    
+    vector<pair<int, int>> out;
+    auto cursor = tree.scan(10);
+    ASSERT_EQUAL(cursor.next(5, out), 5u);
+    ASSERT_EQUAL(out.back().first, 14);
+    
+    tree.remove(15);
+    tree.remove(16);
+    ASSERT_EQUAL(cursor.next(2, out), 2u);
+    ASSERT_EQUAL(out[5].first, 17);
+    ASSERT_EQUAL(out[6].second, 18 * 18);
+    
+    while (!cursor.done()) {
+        cursor.next(16, out);
+    }
+    ASSERT_EQUAL(out.size(), 88u);
+    ASSERT_EQUAL(out.back().first, 99);
+}
+
+void ConcurrentScanTest()
+{
+    avl_tree<int, int> tree;
+    for (int i = 0; i < 1000; i += 2) {
+        tree.insert(i, i);
+    }
+    
+    thread writer([&tree] {
+        for (int i = 1; i < 1000; i += 2) {
+            tree.insert(i, i);
+        }
+    });
+    
+    atomic<bool> ordered(true);
+    vector<thread> readers;
+    for (int i = 0; i < 3; i++) {
+        readers.push_back(thread([&tree, &ordered] {
+            vector<pair<int, int>> out;
+            auto cursor = tree.scan();
+            while (!cursor.done()) {
+                cursor.next(32, out);
+            }
+            for (size_t j = 1; j < out.size(); j++) {
+                if (out[j - 1].first >= out[j].first) {
+                    ordered = false;
+                }
+            }
+        }));
+    }
+    
+    writer.join();
+    for (auto& i : readers) {
+        i.join();
+    }
+    ASSERT_EQUAL(ordered.load(), true);
+    
+    int expected = 0;
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        ASSERT_EQUAL(it.key(), expected++);
+    }
+    ASSERT_EQUAL(expected, 1000);
+}
+
+void BatchTest()
+{
+    using op = avl_tree<int, string>::batch_op;
+    avl_tree<int, string> tree;
+    tree.insert(5, "five");
+    
+    vector<op> ops;
+    ops.push_back(op(op::find_op, 7));
+    ops.push_back(op(op::insert_op, 7, "seven"));
+    ops.push_back(op(op::find_op, 7));
+    ops.push_back(op(op::insert_op, 5, "other"));
+    ops.push_back(op(op::remove_op, 3));
+    ops.push_back(op(op::remove_op, 5));
+    ops.push_back(op(op::find_op, 5));
+    ops.push_back(op(op::insert_op, 1, "one"));
+    tree.apply_batch(ops);
+    
+    ASSERT_EQUAL(ops[0].result, false);
+    ASSERT_EQUAL(ops[1].result, true);
+    ASSERT_EQUAL(ops[2].result, true);
+    ASSERT_EQUAL(ops[2].value, "seven");
+    ASSERT_EQUAL(ops[3].result, false);
+    ASSERT_EQUAL(ops[4].result, false);
+    ASSERT_EQUAL(ops[5].result, true);
+    ASSERT_EQUAL(ops[6].result, false);
+    ASSERT_EQUAL(ops[7].result, true);
+    
+    ASSERT_EQUAL(tree.size(), 2u);
+    ASSERT_EQUAL(tree.begin().key(), 1);
+    ASSERT_EQUAL(tree.rbegin().key(), 7);
+}
+
+void BatchMergeTest()
+{
+    using op = avl_tree<int, int>::batch_op;
+    avl_tree<int, int> tree;
+    map<int, int> model;
+    for (int i = 0; i < 3000; i += 3) {
+        tree.insert(i, i);
+        model[i] = i;
+    }
+    
+    // mixed operations, many on keys already in the tree and some repeated
+    vector<op> ops;
+    for (int i = 0; i < 6000; i++) {
+        int key = (i * 7919) % 4000;
+        ops.push_back(op(static_cast<op::op_kind>((i * 31 + i / 7) % 3), key, i));
+    }
+    tree.apply_batch(ops);
+    
+    vector<size_t> order(ops.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&ops](size_t a, size_t b) {
+        return ops[a].key < ops[b].key;
+    });
+    for (size_t i : order) {
+        const op& o = ops[i];
+        auto it = model.find(o.key);
+        ASSERT_EQUAL(o.result, o.kind == op::insert_op ? it == model.end() : it != model.end());
+        if (o.kind == op::insert_op && it == model.end()) {
+            model[o.key] = o.value;
+        }
+        else if (o.kind == op::remove_op && it != model.end()) {
+            model.erase(it);
+        }
+        else if (o.kind == op::find_op && it != model.end()) {
+            ASSERT_EQUAL(o.value, it -> second);
+        }
+    }
+    
+    ASSERT_EQUAL(tree.size(), model.size());
+    auto it = tree.begin();
+    for (auto& el : model) {
+        ASSERT_EQUAL(it.key(), el.first);
+        ASSERT_EQUAL(it.value(), el.second);
+        ++it;
+    }
+    ASSERT_EQUAL(it == tree.end(), true);
+    ASSERT_EQUAL(tree.rbegin().key(), model.rbegin() -> first);
+    
+    // and the tree keeps working one operation at a time
+    for (auto& el : model) {
+        tree.remove(el.first);
+    }
+    ASSERT_EQUAL(tree.empty(), true);
+}
+
+void FlatCombiningTest()
+{
+    fc_avl_tree<int, int> tree;
+    vector<thread> ths;
+    int thNum = 8;
+    int elNum = 500;
+    
+    auto startTime = chrono::high_resolution_clock::now();
+    
+    for (int i = 0; i < thNum; i++) {
+        ths.push_back(thread([&tree, thNum, elNum](int th) {
+            for (int j = 0; j < elNum; j++) {
+                tree.insert(j * thNum + th, th);
+            }
+            for (int j = 0; j < elNum; j += 2) {
+                tree.remove(j * thNum + th);
+            }
+        }, i));
+    }
+    for (auto& i : ths) {
+        i.join();
+    }
+    
+    auto endTime = chrono::high_resolution_clock::now();
+    auto time = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+    cout << (double)time.count() / 1000.0 << endl;
+    
+    ASSERT_EQUAL(tree.size(), size_t(thNum * elNum / 2));
+    // insert hands back the element like avl_tree::insert, old or new
+    auto kept = tree.insert(thNum + 1, 5);
+    ASSERT_EQUAL(kept.key(), thNum + 1);
+    ASSERT_EQUAL(*kept, 1);
+    ASSERT_EQUAL(*tree.insert(-1, 7), 7);
+    ASSERT_EQUAL(tree.remove(-1), true);
+    ASSERT_EQUAL(tree.remove(0), false);
+    ASSERT_EQUAL(tree.find(thNum + 3).value(), 3);
+}
+
+void ShardedMapTest()
+{
+    sharded_avl_map<int, int> map(4);
+    vector<thread> ths;
+    int thNum = 4;
+    int elNum = 500;
+    
+    for (int i = 0; i < thNum; i++) {
+        ths.push_back(thread([&map, thNum, elNum](int th) {
+            for (int j = 0; j < elNum; j++) {
+                map.insert(j * thNum + th, j);
+                if (j == elNum / 2 && th == 0) {
+                    map.rebalance();
+                }
+            }
+        }, i));
+    }
+    for (auto& i : ths) {
+        i.join();
+    }
+    map.rebalance();
+    map.remove(7);
+    
+    ASSERT_EQUAL(map.size(), size_t(thNum * elNum - 1));
+    int value = 0;
+    ASSERT_EQUAL(map.find(7, value), false);
+    ASSERT_EQUAL(map.find(1999, value), true);
+    ASSERT_EQUAL(value, 499);
+    
+    int expected = 0;
+    bool ordered = true;
+    map.for_each([&](int key, int) {
+        if (expected == 7)
+            expected++;
+        ordered = ordered && key == expected;
+        expected++;
+    });
+    ASSERT_EQUAL(ordered, true);
+    ASSERT_EQUAL(expected, thNum * elNum);
+}
+
+void ShardedMapSpreads()
+{
+    sharded_avl_map<int, int> map(4);
+    int elNum = 10000;
+    for (int i = 0; i < elNum; i++) {
+        map.insert(i, i);
+    }
+    
+    // ascending keys all land in the last shard between two layouts
+    auto sizes = map.shard_sizes();
+    ASSERT_EQUAL(sizes.size(), size_t(4));
+    for (size_t s : sizes) {
+        ASSERT_EQUAL(s >= size_t(elNum / 8), true);
+        ASSERT_EQUAL(s <= size_t(elNum / 2), true);
+    }
+    ASSERT_EQUAL(map.size(), size_t(elNum));
+}
+
+void ShardedMapKeepsBounds()
+{
+    sharded_avl_map<int, int> map(vector<int>{100, 200, 300});
+    int elNum = 5000;
+    for (int i = 0; i < elNum; i++) {
+        map.insert(i, i);
+    }
+    
+    // bounds from the caller stay until rebalance is asked for
+    auto sizes = map.shard_sizes();
+    ASSERT_EQUAL(sizes[0], 100u);
+    ASSERT_EQUAL(sizes[3], size_t(elNum - 300));
+    
+    // lookups and updates go on while the bounds move under them
+    atomic<bool> stop(false);
+    atomic<bool> found(true);
+    thread reader([&] {
+        int value = 0;
+        for (int i = 0; !stop; i = (i + 37) % elNum) {
+            if (!map.find(i, value) || value != i) {
+                found = false;
+            }
+        }
+    });
+    thread writer([&] {
+        for (int i = elNum; i < 2 * elNum; i++) {
+            map.insert(i, i);
+        }
+    });
+    map.rebalance();
+    writer.join();
+    stop = true;
+    reader.join();
+    ASSERT_EQUAL(found.load(), true);
+    
+    map.rebalance();
+    for (size_t s : map.shard_sizes()) {
+        ASSERT_EQUAL(s, size_t(elNum / 2));
+    }
+    int expected = 0;
+    bool ordered = true;
+    map.for_each([&](int key, int) {
+        ordered = ordered && key == expected++;
+    });
+    ASSERT_EQUAL(ordered, true);
+    ASSERT_EQUAL(expected, 2 * elNum);
+}
+
+void OptimisticFindTest()
+{
+    avl_tree<int, int> tree(true);
+    int elNum = 1000;
+    for (int i = 0; i < elNum; i += 2) {
+        tree.insert(i, i);
+    }
+    
+    atomic<bool> found(true);
+    thread writer([&tree, elNum] {
+        for (int round = 0; round < 5; round++) {
+            for (int i = 1; i < elNum; i += 2) {
+                tree.insert(i, i);
+            }
+            for (int i = 1; i < elNum; i += 2) {
+                tree.remove(i);
+            }
+        }
+    });
+    
+    vector<thread> readers;
+    for (int i = 0; i < 3; i++) {
+        readers.push_back(thread([&tree, &found, elNum] {
+            for (int round = 0; round < 10; round++) {
+                for (int j = 0; j < elNum; j += 2) {
+                    int value = -1;
+                    if (!tree.find(j, value) || value != j || !tree.contains(j)) {
+                        found = false;
+                    }
+                }
+            }
+        }));
+    }
+    
+    writer.join();
+    for (auto& i : readers) {
+        i.join();
+    }
+    ASSERT_EQUAL(found.load(), true);
+    ASSERT_EQUAL(tree.size(), size_t(elNum / 2));
+    ASSERT_EQUAL(tree.find(3) == tree.end(), true);
+    ASSERT_EQUAL(tree.contains(3), false);
+    
+    tree.clear();
+    ASSERT_EQUAL(tree.contains(0), false);
+    
+    // values that are not plain bytes are copied under the lock
+    avl_tree<int, string> named(true);
+    auto name = [](int i) { return string(40, 'a' + i % 26) + to_string(i); };
+    for (int i = 0; i < elNum; i += 2) {
+        named.insert(i, name(i));
+    }
+    thread renamer([&named, &name, elNum] {
+        for (int i = 1; i < elNum; i += 2) {
+            named.insert(i, name(i));
+        }
+        for (int i = 1; i < elNum; i += 2) {
+            named.remove(i);
+        }
+    });
+    for (int j = 0; j < elNum; j += 2) {
+        string value;
+        if (!named.find(j, value) || value != name(j) || !named.contains(j)) {
+            found = false;
+        }
+    }
+    renamer.join();
+    ASSERT_EQUAL(found.load(), true);
+}
+
+void RcuTest()
+{
+    rcu_avl_tree<int, int> tree;
+    int elNum = 1000;
+    for (int i = 0; i < elNum; i += 2) {
+        tree.insert(i, i);
+    }
+    
+    atomic<bool> consistent(true);
+    thread writer([&tree, elNum] {
+        for (int round = 0; round < 3; round++) {
+            for (int i = 1; i < elNum; i += 2) {
+                tree.insert(i, round);
+            }
+            for (int i = 1; i < elNum; i += 2) {
+                tree.remove(i);
+            }
+        }
+    });
+    
+    vector<thread> readers;
+    for (int i = 0; i < 3; i++) {
+        readers.push_back(thread([&tree, &consistent, elNum] {
+            for (int round = 0; round < 20; round++) {
+                auto snap = tree.read();
+                size_t count = 0;
+                int last = -1;
+                snap.for_each([&](int key, int) {
+                    if (key <= last)
+                        consistent = false;
+                    last = key;
+                    count++;
+                });
+                int value = 0;
+                if (count != snap.size() || !snap.find(elNum / 2, value))
+                    consistent = false;
+            }
+        }));
+    }
+    
+    writer.join();
+    for (auto& i : readers) {
+        i.join();
+    }
+    ASSERT_EQUAL(consistent.load(), true);
+    ASSERT_EQUAL(tree.size(), size_t(elNum / 2));
+    
+    int value = 0;
+    ASSERT_EQUAL(tree.insert(2, 7), false);
+    ASSERT_EQUAL(tree.find(2, value), true);
+    ASSERT_EQUAL(value, 7);
+    ASSERT_EQUAL(tree.find(3, value), false);
+}
+
+template<typename lock_type>
+void ReadMostly(bool optimistic = false)
+{
+    avl_tree<int, int, lock_type> tree(optimistic);
+    vector<thread> ths;
+    int thNum = 8;
+    int elNum = 1000;
+    
+    for (int i = 0; i < elNum; i++) {
+        tree.insert(i, i);
+    }
+    
+    atomic<bool> consistent = {true};
+    auto startTime = chrono::high_resolution_clock::now();
+    
+    for (int i = 0; i < thNum; i++) {
+        ths.push_back(thread([&tree, &consistent, elNum](int th) {
+            for (int j = 0; j < 20 * elNum; j++) {
+                int key = (j * 7 + th) % elNum;
+                if (th == 0 && j % 100 == 0) {
+                    tree.insert(key, key);
+                } else if (j % 3 == 0) {
+                    // the only lookup that stays off the lock in optimistic mode
+                    int value = -1;
+                    if (!tree.find(key, value) || value != key)
+                        consistent = false;
+                } else if (j % 3 == 1) {
+                    if (tree.find(key).key() != key)
+                        consistent = false;
+                } else {
+                    // operator* reads through value(), both under the tree lock
+                    if (*tree.find(key) != key)
+                        consistent = false;
+                }
+            }
+        }, i));
+    }
+    for (auto& i : ths) {
+        i.join();
+    }
+    
+    auto endTime = chrono::high_resolution_clock::now();
+    auto time = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+    cout << (double)time.count() / 1000.0 << endl;
+    ASSERT_EQUAL(consistent.load(), true);
+}
+
+/*
+ Two readers hand a snapshot back and forth, so at every write one of
+ them is inside. Replaced nodes must be freed anyway once the snapshot
+ that saw them is closed.
+*/
+void RcuReclaimTest()
+{
+    rcu_avl_tree<int, int> tree;
+    int elNum = 1000;
+    for (int i = 0; i < elNum; i++) {
+        tree.insert(i, i);
+    }
+    
+    // 1 opens a snapshot, 2 closes it, 3 stops; the reader answers with 0
+    atomic<int> cmd[2];
+    atomic<bool> consistent(true);
+    vector<thread> readers;
+    for (int r = 0; r < 2; r++) {
+        cmd[r] = 0;
+        readers.push_back(thread([&tree, &cmd, &consistent](int r) {
+            while (true) {
+                while (cmd[r] == 0) {
+                    this_thread::yield();
+                }
+                if (cmd[r] == 3) {
+                    return;
+                }
+                {
+                    auto snap = tree.read();
+                    int value = 0;
+                    if (!snap.find(0, value) || snap.size() != 1000)
+                        consistent = false;
+                    cmd[r] = 0;
+                    while (cmd[r] != 2) {
+                        this_thread::yield();
+                    }
+                }
+                cmd[r] = 0;
+            }
+        }, r));
+    }
+    auto order = [&cmd](int r, int c) {
+        cmd[r] = c;
+        while (cmd[r] != 0) {
+            this_thread::yield();
+        }
+    };
+    
+    int rounds = 100;
+    int batch = 20;
+    order(0, 1);
+    for (int round = 0; round < rounds; round++) {
+        order((round + 1) % 2, 1);
+        order(round % 2, 2);
+        for (int i = 0; i < batch; i++) {
+            tree.insert((round * batch + i) % elNum, round);
+        }
+    }
+    // each insert replaced a path of about ten nodes, a few batches may wait
+    size_t retired = tree.retired();
+    order(rounds % 2, 2);
+    cmd[0] = cmd[1] = 3;
+    for (auto& i : readers) {
+        i.join();
+    }
+    
+    ASSERT_EQUAL(consistent.load(), true);
+    ASSERT_EQUAL(retired < size_t(rounds * batch), true);
+}
+
+void ReadMostlyMutex()
+{
+    ReadMostly<shared_timed_mutex>();
+}
+
+void ReadMostlyBravo()
+{
+    ReadMostly<bravo_rw_lock>();
+}
+
+// a reader that locks again while a writer waits for it must not block
+void BravoNestedRead()
+{
+    bravo_rw_lock lock;
+    atomic<bool> written = {false};
+    
+    lock.lock_shared();
+    thread writer([&lock, &written] {
+        lock.lock();
+        written = true;
+        lock.unlock();
+    });
+    this_thread::sleep_for(chrono::milliseconds(20));
+    lock.lock_shared();
+    ASSERT_EQUAL(written.load(), false);
+    lock.unlock_shared();
+    lock.unlock_shared();
+    writer.join();
+    ASSERT_EQUAL(written.load(), true);
+}
+
+void ReadMostlyOptimistic()
+{
+    ReadMostly<shared_timed_mutex>(true);
+}
+
+struct coarse_tree_lock {
+    static const char* name() {
+        return "avl_tree::_mutex";
+    }
+};
+
+void InstrumentedLockTest()
+{
+    using lock_type = instrumented_lock<shared_timed_mutex, coarse_tree_lock>;
+    avl_tree<int, int, lock_type> tree;
+    vector<thread> ths;
+    int thNum = 4;
+    int elNum = 500;
+    
+    auto waits = lock_type::stats().wait.count();
+    auto shared_holds = lock_type::stats().shared_hold.count();
+    
+    for (int i = 0; i < thNum; i++) {
+        ths.push_back(thread([&tree, elNum](int th) {
+            for (int j = 0; j < elNum; j++) {
+                tree.insert(th * elNum + j, j);
+                ASSERT_EQUAL(tree.find(th * elNum + j).key(), th * elNum + j);
+            }
+        }, i));
+    }
+    for (auto& i : ths) {
+        i.join();
+    }
+    
+    ASSERT_EQUAL(tree.size(), size_t(thNum * elNum));
+    ASSERT_EQUAL(lock_type::stats().wait.count() - waits >= size_t(thNum * elNum), true);
+    ASSERT_EQUAL(lock_type::stats().shared_hold.count() - shared_holds >= size_t(thNum * elNum), true);
+    ASSERT_EQUAL(lock_type::stats().hold.count(), lock_type::stats().wait.count());
+    lock_stats::dump_all(cout);
+}
+
+void ParallelAlgorithmsTest()
+{
+    avl_tree<int, int> tree;
+    int elNum = 20000;
+    for (int i = 0; i < elNum; i++) {
+        tree.insert(i, i);
+    }
+    
+    // keys arrive in order, so every consistent view holds 0..count-1
+    thread writer([&tree, elNum]() {
+        for (int i = elNum; i < 2 * elNum; i++) {
+            tree.insert(i, i);
+        }
+    });
+    for (int round = 0; round < 20; round++) {
+        auto res = tree.parallel_reduce(make_pair(0LL, 0LL),
+                                        [](int key, int) { return make_pair(1LL, (long long)key); },
+                                        [](pair<long long, long long> a, pair<long long, long long> b) {
+                                            return make_pair(a.first + b.first, a.second + b.second);
+                                        }, 4);
+        ASSERT_EQUAL(res.second, res.first * (res.first - 1) / 2);
+    }
+    writer.join();
+    
+    tree.parallel_transform_values([](int, int value) { return -value; }, 4);
+    atomic<long long> sum(0);
+    tree.parallel_for_each([&sum](int key, int value) { sum += key + value; }, 4);
+    ASSERT_EQUAL(sum.load(), 0LL);
+    ASSERT_EQUAL(tree.find(2 * elNum - 1).value(), 1 - 2 * elNum);
+    
+    // an optimistic find must not copy a value the transform is halfway through;
+    // the values are long, so a reader that gets preempted is likely mid-copy
+    struct block { int words[1024]; };
+    avl_tree<int, block> blocks(true);
+    for (int i = 0; i < 64; i++) {
+        block value;
+        fill(begin(value.words), end(value.words), i);
+        blocks.insert(i, value);
+    }
+    atomic<bool> stop(false);
+    atomic<bool> torn(false);
+    thread reader([&blocks, &stop, &torn]() {
+        block value;
+        while (!stop) {
+            for (int i = 0; i < 64; i++) {
+                if (!blocks.find(i, value) ||
+                    count(begin(value.words), end(value.words), value.words[0]) != 1024)
+                    torn = true;
+            }
+        }
+    });
+    for (int round = 0; round < 2000; round++) {
+        blocks.parallel_transform_values([](int, block value) {
+            for (auto& w : value.words) {
+                w++;
+            }
+            return value;
+        }, 4);
+    }
+    stop = true;
+    reader.join();
+    ASSERT_EQUAL(torn.load(), false);
+}
+
 void Test()
 {
     TestRunner tr;
     RUN_TEST(tr, AtomacityTestAdd);
     RUN_TEST(tr, AtomacityTestErase);
+    RUN_TEST(tr, ExtremesTest);
+    RUN_TEST(tr, ScanTest);
+    RUN_TEST(tr, ConcurrentScanTest);
+    RUN_TEST(tr, BatchTest);
+    RUN_TEST(tr, BatchMergeTest);
+    RUN_TEST(tr, FlatCombiningTest);
+    RUN_TEST(tr, ShardedMapTest);
+    RUN_TEST(tr, ShardedMapSpreads);
+    RUN_TEST(tr, ShardedMapKeepsBounds);
+    RUN_TEST(tr, OptimisticFindTest);
+    RUN_TEST(tr, RcuTest);
+    RUN_TEST(tr, RcuReclaimTest);
+    RUN_TEST(tr, ReadMostlyMutex);
+    RUN_TEST(tr, ReadMostlyBravo);
+    RUN_TEST(tr, BravoNestedRead);
+    RUN_TEST(tr, ReadMostlyOptimistic);
+    RUN_TEST(tr, InstrumentedLockTest);
+    RUN_TEST(tr, ParallelAlgorithmsTest);
 }
@@ -1,14 +1,28 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <utility>
+#include <vector>
+#include <cstdint>
 #include <shared_mutex>
+#include <thread>
+#include <type_traits>
 #include "smart_pointer.h"
+#include "avl_height.h"
+#include "epoch_reclaimer.h"
+#include "parallel_subtrees.h"
 
 using smart_pointer::SmartPointer;
 using std::shared_timed_mutex;
 using std::unique_lock;
 using std::shared_lock;
 
-template<typename key_type, typename value_type>
+/*
+ lock_type guards the whole tree; any SharedMutex works, e.g.
+ bravo_rw_lock for read-mostly use on many cores
+*/
+template<typename key_type, typename value_type, typename lock_type = shared_timed_mutex>
 class avl_tree
 {
     
@@ -16,10 +30,10 @@ class avl_tree
     {
         key_type _key;
         value_type _value;
-        unsigned int _height;
         SmartPointer<node> _left;
         SmartPointer<node> _right;
-        bool deleted;
+        std::uint8_t _height : avl_height_bits;
+        std::uint8_t deleted : 1;
         
         node(key_type key, value_type value)
         {
@@ -34,7 +48,40 @@ class avl_tree
     using nodepntr = SmartPointer<node>;
     nodepntr _tree;
     size_t _size = 0;
-    mutable shared_timed_mutex _mutex;
+    // leftmost and rightmost nodes, null for an empty tree
+    nodepntr _min;
+    nodepntr _max;
+    mutable lock_type _mutex;
+    
+    /*
+     Optimistic mode: writers make _version odd for the time they change
+     the tree, lookups walk it without the lock and trust the result only
+     if _version stayed the same even value. Child links are read with
+     peek(), an acquire load of the link, and unlinked nodes are retired
+     through _epoch, so a reader never touches freed memory. Keys never
+     change once a node is made. A value may be mid-write while it is
+     copied, so only trivially copyable values are read optimistically.
+    */
+    bool _optimistic;
+    std::atomic<std::uint64_t> _version = {0};
+    epoch_reclaimer _epoch;
+    
+    class write_section
+    {
+        avl_tree& _tree;
+        
+    public:
+        explicit write_section(avl_tree& tree)
+        : _tree(tree)
+        {
+            _tree._version.fetch_add(1, std::memory_order_seq_cst);
+        }
+        
+        ~write_section()
+        {
+            _tree._version.fetch_add(1, std::memory_order_release);
+        }
+    };
     
     typedef class Iterator
     {
@@ -65,56 +112,28 @@ class avl_tree
         
         value_type& value()
         {
-            shared_lock<shared_timed_mutex> lock(_tree._mutex);
+            shared_lock<lock_type> lock(_tree._mutex);
             return _node -> _value;
         }
         
         value_type& operator*()
         {
-            shared_lock<shared_timed_mutex> lock(_tree._mutex);
             return value();
         }
         
         key_type& key()
         {
-            shared_lock<shared_timed_mutex> lock(_tree._mutex);
+            shared_lock<lock_type> lock(_tree._mutex);
             return _node -> _key;
         }
         
         Iterator operator++()
         {
-            unique_lock<shared_timed_mutex> lock(_tree._mutex);
-            if(!_node){
-                return *this;
-            }
-            
-            if (!_node -> deleted && _node -> _right) {
-                _node = _node -> _right;
-                
-                while (_node -> _left)
-                    _node = _node -> _left;
-                return *this;
-                
-            } else {
-                
-                nodepntr q = _tree._tree-> _left;
-                nodepntr l;
-                
-                while (q) {
-                    if (q -> _key > _node -> _key) {
-                        l = q;
-                        q = q -> _left;
-                        
-                    } else if (q -> _key < _node -> _key)
-                        q = q -> _right;
-                    
-                    else
-                        break;
-                }
-                
-                _node = l;
-                return *this;
+            shared_lock<lock_type> lock(_tree._mutex);
+            if(_node){
+                _node = _tree._next(_node);
             }
+            return *this;
         }
         
         const Iterator operator++(int)
@@ -126,36 +145,11 @@ class avl_tree
         
         Iterator operator--()
         {
-            unique_lock<shared_timed_mutex> lock(_tree._mutex);
-            if(!_node) {
-                return *this;
-            }
-            
-            if (!_node -> deleted && _node -> _left) {
-                _node =  _node -> _left;
-                while (_node -> _right)
-                    _node = _node -> _right;
-                return *this;
-            }
-            else {
-                nodepntr q = _tree._tree -> _left;
-                nodepntr l;
-                
-                while (q) {
-                    if (q -> _key < _node -> _key) {
-                        l = q;
-                        q = q -> _right;
-                    }
-                    else if (q -> _key > _node -> _key)
-                        q = q -> _left;
-                    else{
-                        break;
-                    }
-                }
-                
-                _node = l;
-                return *this;
+            shared_lock<lock_type> lock(_tree._mutex);
+            if(_node) {
+                _node = _tree._prev(_node);
             }
+            return *this;
         }
         
         const Iterator operator--(int)
@@ -169,11 +163,52 @@ class avl_tree
     
     friend Iterator;
     
+    /*
+     Range scan that keeps one shared lock for a whole batch of steps
+     instead of locking per element. Elements are handed out as copies,
+     so nothing refers into the tree once the lock is released.
+    */
+    class Cursor
+    {
+        avl_tree& _tree;
+        nodepntr _node;
+        
+    public:
+        Cursor(avl_tree& tree, nodepntr node)
+        : _tree(tree), _node(node)
+        {}
+        
+        // appends up to n elements to out, returns how many were added
+        size_t next(size_t n, std::vector<std::pair<key_type, value_type>>& out)
+        {
+            shared_lock<lock_type> lock(_tree._mutex);
+            
+            // the element we stopped at was removed between batches
+            if (_node && _node -> deleted) {
+                _node = _tree._lower_bound(_node -> _key);
+            }
+            
+            size_t taken = 0;
+            while (_node && taken < n) {
+                out.emplace_back(_node -> _key, _node -> _value);
+                _node = _tree._next(_node);
+                taken++;
+            }
+            return taken;
+        }
+        
+        bool done() const
+        {
+            return !_node;
+        }
+    };
+    
 public:
     
-    avl_tree() :
+    explicit avl_tree(bool optimistic = false) :
     _tree(new node(key_type(), value_type())),
-    _size(0)
+    _size(0),
+    _optimistic(optimistic)
     {}
     
     avl_tree(avl_tree& tree): avl_tree()
@@ -188,7 +223,43 @@ public:
     
     Iterator begin()
     {
-        return Iterator(*this, findMin(_tree -> _left));
+        shared_lock<lock_type> lock(_mutex);
+        return Iterator(*this, _min);
+    }
+    
+    // last element, walk it with operator--
+    Iterator rbegin()
+    {
+        shared_lock<lock_type> lock(_mutex);
+        return Iterator(*this, _max);
+    }
+    
+    Iterator rend()
+    {
+        return end();
+    }
+    
+    Iterator min()
+    {
+        return begin();
+    }
+    
+    Iterator max()
+    {
+        return rbegin();
+    }
+    
+    Cursor scan()
+    {
+        shared_lock<lock_type> lock(_mutex);
+        return Cursor(*this, _min);
+    }
+    
+    // scan starting at the first key not less than from
+    Cursor scan(const key_type& from)
+    {
+        shared_lock<lock_type> lock(_mutex);
+        return Cursor(*this, _lower_bound(from));
     }
     
     Iterator end()
@@ -198,45 +269,162 @@ public:
     
     size_t size()
     {
-        shared_lock<shared_timed_mutex> lock(_mutex);
-        return _size();
+        shared_lock<lock_type> lock(_mutex);
+        return _size;
     }
     
     bool empty() const
     {
-        shared_lock<shared_timed_mutex> lock(_mutex);
+        shared_lock<lock_type> lock(_mutex);
         return _size == static_cast<size_t>(0);
     }
     
+    // memory taken by one element of the tree, without allocator overhead
+    static constexpr size_t node_size()
+    {
+        return sizeof(node);
+    }
+    
     void clear()
     {
-        unique_lock<shared_timed_mutex> lock(_mutex);
+        unique_lock<lock_type> lock(_mutex);
+        write_section section(*this);
         _size = 0U;
+        _min = _max = nullptr;
+        
+        // readers still walking the old nodes keep them until their epoch ends
+        if (_optimistic && _tree -> _left){
+            _epoch.retire(new nodepntr(_tree -> _left), [](void* p){
+                nodepntr* root = static_cast<nodepntr*>(p);
+                _destroy(std::move(*root));
+                delete root;
+            });
+        }
+        else {
+            _destroy(_tree -> _left);
+        }
         _tree -> _left = NULL;
     }
     
     Iterator insert(const key_type& key, const value_type& value)
     {
-        unique_lock<shared_timed_mutex> lock(_mutex);
-        _tree -> _left = _insert(_tree -> _left, key, value);
-        _size++;
-        return Iterator(*this, _find(_tree -> _left, key));
+        unique_lock<lock_type> lock(_mutex);
+        write_section section(*this);
+        return Iterator(*this, _insert_key(key, value));
     }
     
     void remove(const key_type& key)
     {
-        unique_lock<shared_timed_mutex> lock(_mutex);
-        _tree -> _left = _remove(_tree -> _left, key);
-        _size--;
+        unique_lock<lock_type> lock(_mutex);
+        write_section section(*this);
+        _remove_key(key);
     }
     
-    Iterator find(const key_type& key)
+    /*
+     One operation of apply_batch. result reports whether an insert added
+     a new key, a remove found its key, or a find succeeded; a successful
+     find also stores the value it saw in value. at(op) is the iterator
+     insert() would have returned.
+    */
+    struct batch_op
     {
-        shared_lock<shared_timed_mutex> lock(_mutex);
+        enum op_kind { insert_op, remove_op, find_op };
+        
+        op_kind kind;
+        key_type key;
+        value_type value;
+        bool result;
+        // the node holding key after an insert or a successful find
+        nodepntr position;
+        
+        batch_op(op_kind kind, const key_type& key, const value_type& value = value_type())
+        : kind(kind), key(key), value(value), result(false)
+        {}
+    };
+    
+    /*
+     Runs all operations under a single exclusive lock hold. They are
+     applied in key order, operations on the same key keep their relative
+     order, so every result is what running them one by one would give.
+     The sorted batch goes down the tree in one pass: every node is
+     visited once for all the keys below it, not once per operation.
+    */
+    void apply_batch(std::vector<batch_op>& ops)
+    {
+        std::vector<size_t> order(ops.size());
+        for (size_t i = 0; i < order.size(); i++){
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&ops](size_t a, size_t b){
+            return ops[a].key < ops[b].key;
+        });
+        
+        unique_lock<lock_type> lock(_mutex);
+        write_section section(*this);
+        if (order.empty()){
+            return;
+        }
+        _tree -> _left = _merge(_tree -> _left, ops, order, 0, order.size());
+        
         if (!_tree -> _left){
-            return end();
+            _min = _max = nullptr;
+        }
+        else {
+            _min = findMin(_tree -> _left);
+            _max = findMax(_tree -> _left);
         }
-        return Iterator(*this, _find(_tree -> _left, key));
+    }
+    
+    Iterator at(const batch_op& op)
+    {
+        return Iterator(*this, op.position);
+    }
+    
+    /*
+     An iterator holds a reference to its node, and taking one writes the
+     node's count, so this find() always locks. In optimistic mode use
+     find(key, value) or contains() for lookups that write nothing shared.
+    */
+    Iterator find(const key_type& key)
+    {
+        shared_lock<lock_type> lock(_mutex);
+        const nodepntr* link = _find(key);
+        return link ? Iterator(*this, *link) : end();
+    }
+    
+    // copies the value out, false if the key is absent
+    bool find(const key_type& key, value_type& value)
+    {
+        bool found = false;
+        auto read = [&](node* q){
+            found = q != nullptr;
+            if (found){
+                value = q -> _value;
+            }
+        };
+        // a torn copy of a value like std::string could crash before validation
+        if (std::is_trivially_copyable<value_type>::value && _optimistic && _find_optimistic(key, read)){
+            return found;
+        }
+        
+        shared_lock<lock_type> lock(_mutex);
+        const nodepntr* link = _find(key);
+        read(link ? link -> peek() : nullptr);
+        return found;
+    }
+    
+    bool contains(const key_type& key)
+    {
+        bool found = false;
+        auto read = [&found](node* q){ found = q != nullptr; };
+        if (_optimistic && _find_optimistic(key, read)){
+            return found;
+        }
+        
+        shared_lock<lock_type> lock(_mutex);
+        const nodepntr* link = _find(key);
+        read(link ? link -> peek() : nullptr);
+        return found;
     }
     
     value_type& operator[](const key_type& key)
@@ -251,6 +439,42 @@ public:
         return res.value();
     }
     
+    /*
+     Parallel algorithms: the tree is cut at its top levels and the
+     subtrees go to up to threads threads. f and map run on several
+     threads at once. for_each and reduce hold the lock shared for the
+     whole run, transform holds it exclusively.
+    */
+    template<typename Func>
+    void parallel_for_each(Func f, unsigned threads = std::thread::hardware_concurrency())
+    {
+        shared_lock<lock_type> lock(_mutex);
+        parallel_subtrees::for_each(_tree -> _left.peek(), threads, [&f](node* n){
+            f(static_cast<const key_type&>(n -> _key), static_cast<const value_type&>(n -> _value));
+        });
+    }
+    
+    // map(key, value) of every element, joined in key order by an associative combine
+    template<typename T, typename Map, typename Combine>
+    T parallel_reduce(T init, Map map, Combine combine, unsigned threads = std::thread::hardware_concurrency())
+    {
+        shared_lock<lock_type> lock(_mutex);
+        return parallel_subtrees::reduce(_tree -> _left.peek(), threads, init, [&map](node* n){
+            return map(static_cast<const key_type&>(n -> _key), static_cast<const value_type&>(n -> _value));
+        }, combine);
+    }
+    
+    // value = f(key, value) for every element
+    template<typename Func>
+    void parallel_transform_values(Func f, unsigned threads = std::thread::hardware_concurrency())
+    {
+        unique_lock<lock_type> lock(_mutex);
+        write_section section(*this);
+        parallel_subtrees::for_each(_tree -> _left.peek(), threads, [&f](node* n){
+            n -> _value = f(static_cast<const key_type&>(n -> _key), n -> _value);
+        });
+    }
+    
     ~avl_tree()
     {
         clear();
@@ -258,6 +482,31 @@ public:
     
 private:
     
+    // releases the subtree node by node, without recursive destructors
+    static void _destroy(nodepntr root)
+    {
+        std::vector<nodepntr> stack;
+        
+        if (root){
+            stack.push_back(std::move(root));
+        }
+        
+        while (!stack.empty()){
+            nodepntr nd = std::move(stack.back());
+            stack.pop_back();
+            
+            if (nd -> _left){
+                stack.push_back(nd -> _left);
+            }
+            if (nd -> _right){
+                stack.push_back(nd -> _right);
+            }
+            // nd goes at the end of this pass and takes no children along
+            nd -> _left = nullptr;
+            nd -> _right = nullptr;
+        }
+    }
+    
     unsigned int height(nodepntr _node)
     {
         return _node ? _node -> _height : 0;
@@ -318,6 +567,7 @@ private:
     nodepntr _insert(nodepntr _node, key_type key, value_type val)
     {
         if( !_node ){
+            _size++;
             return nodepntr(new node(key, val));
         }
         
@@ -347,24 +597,304 @@ private:
         return _node -> _right ? findMax(_node -> _right) : _node;
     }
     
-    nodepntr _find(nodepntr _node, const key_type& key)
+    /*
+     Lock-free lookup for optimistic mode, false if a writer interfered.
+     The walk keeps raw pointers and the epoch keeps the nodes alive, so
+     nothing shared is written. read(q) gets the node found, null for an
+     absent key, and has to copy out what it needs: its result only
+     counts when true comes back. deleted is not read: it shares a byte
+     with the height rotations rewrite, and a node removed during the
+     walk moves _version anyway.
+    */
+    template<typename Read>
+    bool _find_optimistic(const key_type& key, Read& read)
     {
-        if(_node -> _left && _node -> _key > key){
-            return _find(_node -> _left, key);
+        epoch_reclaimer::guard guard(_epoch);
+        std::uint64_t version = _version.load(std::memory_order_acquire);
+        if (version & 1){
+            return false;
         }
         
-        else if (_node -> _right && _node -> _key < key){
-            return _find(_node -> _right, key);
+        node* q = _tree.peek() -> _left.peek();
+        // a walk longer than any AVL height means we raced with a rotation
+        for (int depth = 0; q && depth < max_optimistic_depth; depth++){
+            if (key < q -> _key){
+                q = q -> _left.peek();
+            }
+            else if (q -> _key < key){
+                q = q -> _right.peek();
+            }
+            else {
+                break;
+            }
+        }
+        if (q && !(q -> _key == key)){
+            return false;
         }
+        read(q);
+        
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return _version.load(std::memory_order_relaxed) == version;
+    }
+    
+    // insert/remove bodies, the caller holds _mutex exclusively
+    nodepntr _insert_key(const key_type& key, const value_type& value)
+    {
+        _tree -> _left = _insert(_tree -> _left, key, value);
         
-        else if (_node -> _key != key){
+        nodepntr nd = *_find(key);
+        if (!_min || key < _min -> _key){
+            _min = nd;
+        }
+        if (!_max || key > _max -> _key){
+            _max = nd;
+        }
+        return nd;
+    }
+    
+    bool _remove_key(const key_type& key)
+    {
+        size_t before = _size;
+        _tree -> _left = _remove(_tree -> _left, key);
+        
+        if (!_tree -> _left){
+            _min = _max = nullptr;
+        }
+        else {
+            if (_min && key == _min -> _key){
+                _min = findMin(_tree -> _left);
+            }
+            if (_max && key == _max -> _key){
+                _max = findMax(_tree -> _left);
+            }
+        }
+        return _size != before;
+    }
+    
+    /*
+     apply_batch over a subtree: ops[order[lo..hi)] are sorted by key and
+     all fall below _node. The run is split at the node's key, the two
+     halves go into the children, and the node, its replacement or
+     nothing is joined back between the results. Returns the new root.
+    */
+    nodepntr _merge(nodepntr _node, std::vector<batch_op>& ops, const std::vector<size_t>& order, size_t lo, size_t hi)
+    {
+        if (lo == hi){
+            return _node;
+        }
+        if (!_node){
+            return _build(ops, order, lo, hi);
+        }
+        
+        auto begin = order.begin();
+        size_t from = std::lower_bound(begin + lo, begin + hi, _node -> _key,
+                                       [&ops](size_t i, const key_type& key){ return ops[i].key < key; }) - begin;
+        size_t to = std::upper_bound(begin + from, begin + hi, _node -> _key,
+                                     [&ops](const key_type& key, size_t i){ return key < ops[i].key; }) - begin;
+        
+        nodepntr left = _merge(_node -> _left, ops, order, lo, from);
+        nodepntr right = _merge(_node -> _right, ops, order, to, hi);
+        nodepntr root = _apply_key(_node, ops, order, from, to);
+        return root ? _join(left, root, right) : _join(left, right);
+    }
+    
+    /*
+     Runs ops[order[lo..hi)], all on one key, against the node holding
+     it, null if absent. Returns the node holding the key afterwards.
+    */
+    nodepntr _apply_key(nodepntr _node, std::vector<batch_op>& ops, const std::vector<size_t>& order, size_t lo, size_t hi)
+    {
+        nodepntr cur = _node;
+        for (size_t i = lo; i < hi; i++){
+            batch_op& op = ops[order[i]];
+            op.result = static_cast<bool>(cur);
+            switch (op.kind){
+                case batch_op::insert_op:
+                    op.result = !cur;
+                    if (!cur){
+                        cur = nodepntr(new node(op.key, op.value));
+                        _size++;
+                    }
+                    op.position = cur;
+                    break;
+                case batch_op::remove_op:
+                    if (cur){
+                        if (cur == _node){
+                            _unlink(_node);
+                        }
+                        cur = nullptr;
+                        _size--;
+                    }
+                    break;
+                case batch_op::find_op:
+                    if (cur){
+                        op.value = cur -> _value;
+                    }
+                    op.position = cur;
+                    break;
+            }
+        }
+        return cur;
+    }
+    
+    // a subtree for the keys an empty spot of the tree gets from the batch
+    nodepntr _build(std::vector<batch_op>& ops, const std::vector<size_t>& order, size_t lo, size_t hi)
+    {
+        std::vector<nodepntr> added;
+        while (lo < hi){
+            size_t next = lo + 1;
+            while (next < hi && !(ops[order[lo]].key < ops[order[next]].key)){
+                next++;
+            }
+            nodepntr nd = _apply_key(nodepntr(nullptr), ops, order, lo, next);
+            if (nd){
+                added.push_back(nd);
+            }
+            lo = next;
+        }
+        return _balanced(added, 0, added.size());
+    }
+    
+    nodepntr _balanced(std::vector<nodepntr>& nodes, size_t lo, size_t hi)
+    {
+        if (lo == hi){
             return nodepntr(nullptr);
-            
         }
-        else{
+        size_t mid = lo + (hi - lo) / 2;
+        nodepntr root = nodes[mid];
+        root -> _left = _balanced(nodes, lo, mid);
+        root -> _right = _balanced(nodes, mid + 1, hi);
+        updHeight(root);
+        return root;
+    }
+    
+    /*
+     All keys of left below root's, all of right above. The two trees may
+     differ in height by any amount: root goes down the taller one's inner
+     spine to the first subtree about as high as the other tree, and the
+     spine is rebalanced on the way back.
+    */
+    nodepntr _join(nodepntr left, nodepntr root, nodepntr right)
+    {
+        if (height(left) > height(right) + 1){
+            left -> _right = _join(left -> _right, root, right);
+            return balance(left);
+        }
+        if (height(right) > height(left) + 1){
+            right -> _left = _join(left, root, right -> _left);
+            return balance(right);
+        }
+        root -> _left = left;
+        root -> _right = right;
+        updHeight(root);
+        return root;
+    }
+    
+    nodepntr _join(nodepntr left, nodepntr right)
+    {
+        if (!left || !right){
+            return left ? left : right;
+        }
+        nodepntr min = findMin(right);
+        return _join(left, min, removeMin(right));
+    }
+    
+    // marks a node taken out of the tree; optimistic readers may still be on it
+    void _unlink(nodepntr _node)
+    {
+        _node -> deleted = true;
+        if (_optimistic){
+            _epoch.retire(new nodepntr(_node));
+        }
+    }
+    
+    static const int max_optimistic_depth = 128;
+    
+    // in-order neighbours, the caller holds _mutex
+    nodepntr _next(nodepntr _node)
+    {
+        if (!_node -> deleted && _node -> _right) {
+            _node = _node -> _right;
+            while (_node -> _left)
+                _node = _node -> _left;
             return _node;
         }
         
+        nodepntr q = _tree -> _left;
+        nodepntr l;
+        while (q) {
+            if (q -> _key > _node -> _key) {
+                l = q;
+                q = q -> _left;
+            }
+            else if (q -> _key < _node -> _key)
+                q = q -> _right;
+            else
+                break;
+        }
+        return l;
+    }
+    
+    nodepntr _prev(nodepntr _node)
+    {
+        if (!_node -> deleted && _node -> _left) {
+            _node = _node -> _left;
+            while (_node -> _right)
+                _node = _node -> _right;
+            return _node;
+        }
+        
+        nodepntr q = _tree -> _left;
+        nodepntr l;
+        while (q) {
+            if (q -> _key < _node -> _key) {
+                l = q;
+                q = q -> _right;
+            }
+            else if (q -> _key > _node -> _key)
+                q = q -> _left;
+            else
+                break;
+        }
+        return l;
+    }
+    
+    nodepntr _lower_bound(const key_type& key)
+    {
+        nodepntr q = _tree -> _left;
+        nodepntr l;
+        while (q) {
+            if (q -> _key < key)
+                q = q -> _right;
+            else {
+                l = q;
+                q = q -> _left;
+            }
+        }
+        return l;
+    }
+    
+    /*
+     The link that holds key, null for an absent key; the caller holds
+     _mutex. The walk goes over raw pointers, so a lookup writes no
+     reference count on the way down and the caller copies only the link
+     it needs.
+    */
+    const nodepntr* _find(const key_type& key) const
+    {
+        const nodepntr* link = &_tree.peek() -> _left;
+        while (node* q = link -> peek()){
+            if (key < q -> _key){
+                link = &q -> _left;
+            }
+            else if (q -> _key < key){
+                link = &q -> _right;
+            }
+            else {
+                return link;
+            }
+        }
+        return nullptr;
     }
     
     nodepntr removeMin(nodepntr _node)
@@ -396,7 +926,8 @@ private:
             nodepntr q = _node -> _left;
             nodepntr r = _node -> _right;
             
-            _node -> deleted = true;
+            _unlink(_node);
+            _size--;
             
             if (!r){
                 return q;
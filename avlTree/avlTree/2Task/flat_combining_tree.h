@@ -0,0 +1,171 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "avl_tree.h"
+#include "read_indicator.h"
+
+using std::shared_timed_mutex;
+
+/*
+ Flat-combining front end for avl_tree. A writer publishes its operation
+ in its own slot; whoever gets the combiner lock collects all published
+ operations and runs them through apply_batch under one hold of the tree
+ lock, then hands the results back. Lookups do not change the tree and
+ go straight to it. The surface is avl_tree's, so callers can switch
+ between the two; remove() also reports whether the key was there.
+*/
+template<typename key_type, typename value_type, typename lock_type = shared_timed_mutex>
+class fc_avl_tree
+{
+    using tree_type = avl_tree<key_type, value_type, lock_type>;
+    using batch_op = typename tree_type::batch_op;
+    
+    enum slot_state { empty_slot, pending_slot, done_slot };
+    
+    struct alignas(64) slot
+    {
+        std::atomic<int> state = {empty_slot};
+        batch_op op = batch_op(batch_op::find_op, key_type());
+    };
+    
+    tree_type _tree;
+    std::mutex _combiner;
+    slot _slots[thread_slot::max_threads];
+    
+public:
+    
+    // the element for key, the one already there if the key was taken
+    auto insert(const key_type& key, const value_type& value)
+    {
+        return _tree.at(_execute(batch_op::insert_op, key, value));
+    }
+    
+    // true if the key was in the tree
+    bool remove(const key_type& key)
+    {
+        return _execute(batch_op::remove_op, key, value_type()).result;
+    }
+    
+    value_type& operator[](const key_type& key)
+    {
+        return insert(key, value_type()).value();
+    }
+    
+    void clear()
+    {
+        _tree.clear();
+    }
+    
+    auto find(const key_type& key)
+    {
+        return _tree.find(key);
+    }
+    
+    bool find(const key_type& key, value_type& value)
+    {
+        return _tree.find(key, value);
+    }
+    
+    bool contains(const key_type& key)
+    {
+        return _tree.contains(key);
+    }
+    
+    auto begin()
+    {
+        return _tree.begin();
+    }
+    
+    auto end()
+    {
+        return _tree.end();
+    }
+    
+    auto rbegin()
+    {
+        return _tree.rbegin();
+    }
+    
+    auto rend()
+    {
+        return _tree.rend();
+    }
+    
+    auto scan()
+    {
+        return _tree.scan();
+    }
+    
+    auto scan(const key_type& from)
+    {
+        return _tree.scan(from);
+    }
+    
+    size_t size()
+    {
+        return _tree.size();
+    }
+    
+    bool empty() const
+    {
+        return _tree.empty();
+    }
+    
+private:
+    
+    batch_op _execute(typename batch_op::op_kind kind, const key_type& key, const value_type& value)
+    {
+        int idx = thread_slot::index();
+        if (idx < 0) {
+            // no slot for this thread, go through the tree lock directly
+            std::vector<batch_op> ops(1, batch_op(kind, key, value));
+            _tree.apply_batch(ops);
+            return ops[0];
+        }
+        
+        slot& my = _slots[idx];
+        my.op = batch_op(kind, key, value);
+        my.state.store(pending_slot, std::memory_order_release);
+        
+        while (my.state.load(std::memory_order_acquire) != done_slot) {
+            if (_combiner.try_lock()) {
+                _combine();
+                _combiner.unlock();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        
+        // the slot lets go of the node, the caller's copy keeps it
+        batch_op done = std::move(my.op);
+        my.state.store(empty_slot, std::memory_order_relaxed);
+        return done;
+    }
+    
+    void _combine()
+    {
+        std::vector<batch_op> ops;
+        std::vector<slot*> owners;
+        
+        for (auto& s : _slots) {
+            if (s.state.load(std::memory_order_acquire) == pending_slot) {
+                ops.push_back(s.op);
+                owners.push_back(&s);
+            }
+        }
+        if (ops.empty())
+            return;
+        
+        _tree.apply_batch(ops);
+        
+        for (size_t i = 0; i < ops.size(); i++) {
+            owners[i] -> op = std::move(ops[i]);
+            owners[i] -> state.store(done_slot, std::memory_order_release);
+        }
+    }
+};
@@ -0,0 +1,363 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "epoch_reclaimer.h"
+#include "avl_height.h"
+
+/*
+ Read-copy-update AVL tree for read-mostly tables. A writer never
+ changes a node that readers can reach: it copies the path from the
+ root to the change (plus whatever the rotations touch), then publishes
+ the new version with a single atomic store. Readers take no lock; a
+ snapshot pins the version it loaded and keeps reading it no matter
+ what writers do meanwhile. Writers serialize on one mutex. Replaced
+ nodes are retired through an epoch_reclaimer and freed once every
+ snapshot that could still see them is gone; snapshots taken later do
+ not hold them up.
+*/
+template<typename key_type, typename value_type>
+class rcu_avl_tree
+{
+    struct node
+    {
+        key_type _key;
+        value_type _value;
+        node* _left;
+        node* _right;
+        std::uint8_t _height : avl_height_bits;
+        // created by the running write, so it may still be changed in place
+        std::uint8_t _fresh : 1;
+        
+        node(const key_type& key, const value_type& value)
+        : _key(key), _value(value), _left(nullptr), _right(nullptr), _height(1), _fresh(1)
+        {}
+    };
+    
+    struct version
+    {
+        node* _root;
+        size_t _size;
+    };
+    
+    std::atomic<version*> _current;
+    std::mutex _writer;
+    
+    epoch_reclaimer _epoch;
+    
+    // state of the running write, guarded by _writer
+    std::vector<node*> _retired;
+    std::vector<node*> _created;
+    
+public:
+    
+    /*
+     Consistent read-only view of one version. Holding a snapshot keeps
+     the nodes it sees alive; it does not block writers.
+    */
+    class snapshot
+    {
+        friend rcu_avl_tree;
+        
+        rcu_avl_tree& _tree;
+        const version* _version;
+        
+        explicit snapshot(rcu_avl_tree& tree)
+        : _tree(tree)
+        {
+            _tree._epoch.enter();
+            _version = _tree._current.load(std::memory_order_acquire);
+        }
+        
+    public:
+        snapshot(const snapshot&) = delete;
+        snapshot& operator=(const snapshot&) = delete;
+        
+        ~snapshot()
+        {
+            _tree._epoch.exit();
+        }
+        
+        bool find(const key_type& key, value_type& value) const
+        {
+            const node* q = _version -> _root;
+            while (q) {
+                if (key < q -> _key)
+                    q = q -> _left;
+                else if (q -> _key < key)
+                    q = q -> _right;
+                else {
+                    value = q -> _value;
+                    return true;
+                }
+            }
+            return false;
+        }
+        
+        size_t size() const
+        {
+            return _version -> _size;
+        }
+        
+        // calls f(key, value) for every element in key order
+        template<typename F>
+        void for_each(F f) const
+        {
+            std::vector<const node*> stack;
+            const node* q = _version -> _root;
+            while (q || !stack.empty()) {
+                while (q) {
+                    stack.push_back(q);
+                    q = q -> _left;
+                }
+                q = stack.back();
+                stack.pop_back();
+                f(q -> _key, q -> _value);
+                q = q -> _right;
+            }
+        }
+    };
+    
+    rcu_avl_tree()
+    : _current(new version{nullptr, 0})
+    {}
+    
+    rcu_avl_tree(const rcu_avl_tree&) = delete;
+    rcu_avl_tree& operator=(const rcu_avl_tree&) = delete;
+    
+    ~rcu_avl_tree()
+    {
+        version* cur = _current.load();
+        std::vector<node*> stack;
+        if (cur -> _root)
+            stack.push_back(cur -> _root);
+        while (!stack.empty()) {
+            node* nd = stack.back();
+            stack.pop_back();
+            if (nd -> _left)
+                stack.push_back(nd -> _left);
+            if (nd -> _right)
+                stack.push_back(nd -> _right);
+            delete nd;
+        }
+        delete cur;
+    }
+    
+    snapshot read()
+    {
+        return snapshot(*this);
+    }
+    
+    bool find(const key_type& key, value_type& value)
+    {
+        return read().find(key, value);
+    }
+    
+    size_t size()
+    {
+        return read().size();
+    }
+    
+    bool empty()
+    {
+        return size() == 0;
+    }
+    
+    // replaced nodes and versions that still wait for old snapshots to go
+    size_t retired()
+    {
+        return _epoch.pending();
+    }
+    
+    // inserts the key or replaces its value, true if the key is new
+    bool insert(const key_type& key, const value_type& value)
+    {
+        std::lock_guard<std::mutex> lock(_writer);
+        version* cur = _current.load(std::memory_order_relaxed);
+        
+        bool created = false;
+        node* root = _insert(cur -> _root, key, value, created);
+        _publish(root, cur -> _size + (created ? 1 : 0));
+        return created;
+    }
+    
+    bool remove(const key_type& key)
+    {
+        std::lock_guard<std::mutex> lock(_writer);
+        version* cur = _current.load(std::memory_order_relaxed);
+        
+        if (!_contains(cur -> _root, key))
+            return false;
+        
+        node* root = _remove(cur -> _root, key);
+        _publish(root, cur -> _size - 1);
+        return true;
+    }
+    
+private:
+    
+    void _publish(node* root, size_t size)
+    {
+        for (node* nd : _created) {
+            nd -> _fresh = 0;
+        }
+        _created.clear();
+        
+        version* old = _current.load(std::memory_order_relaxed);
+        _current.store(new version{root, size}, std::memory_order_seq_cst);
+        
+        // snapshots taken from now on only see the new version
+        for (node* nd : _retired) {
+            _epoch.retire(nd);
+        }
+        _retired.clear();
+        _epoch.retire(old);
+    }
+    
+    node* _make(const key_type& key, const value_type& value)
+    {
+        node* nd = new node(key, value);
+        _created.push_back(nd);
+        return nd;
+    }
+    
+    // a node the running write may change: fresh ones as is, shared ones copied
+    node* _own(node* nd)
+    {
+        if (nd -> _fresh)
+            return nd;
+        
+        node* copy = _make(nd -> _key, nd -> _value);
+        copy -> _left = nd -> _left;
+        copy -> _right = nd -> _right;
+        copy -> _height = nd -> _height;
+        _retired.push_back(nd);
+        return copy;
+    }
+    
+    static unsigned int height(const node* nd)
+    {
+        return nd ? nd -> _height : 0;
+    }
+    
+    static int bfactor(const node* nd)
+    {
+        return height(nd -> _right) - height(nd -> _left);
+    }
+    
+    static void updHeight(node* nd)
+    {
+        unsigned int hl = height(nd -> _left);
+        unsigned int hr = height(nd -> _right);
+        nd -> _height = (hr > hl ? hr : hl) + 1;
+    }
+    
+    // rotations and balance take an owned node and own what they change
+    node* rightRotate(node* nd)
+    {
+        node* tmp = _own(nd -> _left);
+        nd -> _left = tmp -> _right;
+        tmp -> _right = nd;
+        updHeight(nd);
+        updHeight(tmp);
+        return tmp;
+    }
+    
+    node* leftRotate(node* nd)
+    {
+        node* tmp = _own(nd -> _right);
+        nd -> _right = tmp -> _left;
+        tmp -> _left = nd;
+        updHeight(nd);
+        updHeight(tmp);
+        return tmp;
+    }
+    
+    node* balance(node* nd)
+    {
+        updHeight(nd);
+        
+        if (bfactor(nd) == 2) {
+            if (bfactor(nd -> _right) < 0)
+                nd -> _right = rightRotate(_own(nd -> _right));
+            return leftRotate(nd);
+        }
+        if (bfactor(nd) == -2) {
+            if (bfactor(nd -> _left) > 0)
+                nd -> _left = leftRotate(_own(nd -> _left));
+            return rightRotate(nd);
+        }
+        return nd;
+    }
+    
+    static bool _contains(const node* nd, const key_type& key)
+    {
+        while (nd) {
+            if (key < nd -> _key)
+                nd = nd -> _left;
+            else if (nd -> _key < key)
+                nd = nd -> _right;
+            else
+                return true;
+        }
+        return false;
+    }
+    
+    node* _insert(node* nd, const key_type& key, const value_type& value, bool& created)
+    {
+        if (!nd) {
+            created = true;
+            return _make(key, value);
+        }
+        
+        nd = _own(nd);
+        if (key < nd -> _key)
+            nd -> _left = _insert(nd -> _left, key, value, created);
+        else if (nd -> _key < key)
+            nd -> _right = _insert(nd -> _right, key, value, created);
+        else {
+            nd -> _value = value;
+            return nd;
+        }
+        return balance(nd);
+    }
+    
+    node* _remove_min(node* nd, node*& min)
+    {
+        if (!nd -> _left) {
+            min = nd;
+            return nd -> _right;
+        }
+        nd = _own(nd);
+        nd -> _left = _remove_min(nd -> _left, min);
+        return balance(nd);
+    }
+    
+    // the key is known to be present
+    node* _remove(node* nd, const key_type& key)
+    {
+        if (key < nd -> _key || nd -> _key < key) {
+            nd = _own(nd);
+            if (key < nd -> _key)
+                nd -> _left = _remove(nd -> _left, key);
+            else
+                nd -> _right = _remove(nd -> _right, key);
+            return balance(nd);
+        }
+        
+        if (!nd -> _fresh)
+            _retired.push_back(nd);
+        
+        if (!nd -> _right)
+            return nd -> _left;
+        
+        node* min = nullptr;
+        node* right = _remove_min(nd -> _right, min);
+        min = _own(min);
+        min -> _left = nd -> _left;
+        min -> _right = right;
+        return balance(min);
+    }
+};
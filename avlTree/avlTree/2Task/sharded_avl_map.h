@@ -0,0 +1,284 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+#include "avl_tree.h"
+#include "bravo_rw_lock.h"
+
+using std::shared_timed_mutex;
+using std::unique_lock;
+using std::shared_lock;
+
+/*
+ Ordered map split by key ranges into independently locked avl_tree
+ shards. Shard i holds the keys in [_bounds[i - 1], _bounds[i]), so the
+ shards concatenated in order are already sorted; only the first _used
+ bounds are set, the shards past them are still empty.
+ An operation looks its shard up under the layout lock, then works under
+ the shard's own lock, both taken shared. They are bravo_rw_locks, so
+ the shared side stays on per-thread slots and operations on different
+ shards share no cache line. rebalance() moves one bound at a time and
+ locks only the two shards on its sides, the rest of the map keeps going.
+ A map made without bounds lays itself out again from the key quantiles
+ once it has taken as many inserts as it held at the last layout, so it
+ spreads out over its shards as it fills. Bounds given by the caller are
+ kept until rebalance() is called.
+ Lookups return copies: an element may move to another shard after a
+ rebalance, so iterators into a shard would not stay meaningful.
+*/
+template<typename key_type, typename value_type, typename lock_type = shared_timed_mutex>
+class sharded_avl_map
+{
+    using shard_type = avl_tree<key_type, value_type, lock_type>;
+    using batch_op = typename shard_type::batch_op;
+    using element = std::pair<key_type, value_type>;
+    
+    struct shard
+    {
+        shard_type tree;
+        // shared for operations, exclusive to move keys across the shard's bounds
+        bravo_rw_lock lock;
+    };
+    
+    std::vector<std::unique_ptr<shard>> _shards;
+    std::vector<key_type> _bounds;
+    std::atomic<size_t> _used = {0};
+    mutable bravo_rw_lock _layout;
+    // one rebalance at a time
+    std::mutex _relayout;
+    bool _automatic;
+    // inserts since the last layout, and how many trigger the next one
+    std::atomic<size_t> _grown = {0};
+    std::atomic<size_t> _relayout_at = {relayout_min};
+    
+public:
+    
+    // the first relayout_min keys all go to the first shard
+    explicit sharded_avl_map(size_t shards = 8)
+    : _bounds(std::max<size_t>(shards, 1) - 1), _automatic(true)
+    {
+        for (size_t i = 0; i < std::max<size_t>(shards, 1); i++) {
+            _shards.emplace_back(new shard());
+        }
+    }
+    
+    // bounds are the sorted smallest keys of shards 1..n-1
+    explicit sharded_avl_map(const std::vector<key_type>& bounds)
+    : sharded_avl_map(bounds.size() + 1)
+    {
+        _bounds = bounds;
+        _used = bounds.size();
+        _automatic = false;
+    }
+    
+    void insert(const key_type& key, const value_type& value)
+    {
+        _on_shard(key, [&](shard_type& tree) {
+            tree.insert(key, value);
+        });
+        // exactly one insert hits the mark
+        if (_automatic && _grown.fetch_add(1, std::memory_order_relaxed) + 1 ==
+            _relayout_at.load(std::memory_order_relaxed))
+            rebalance();
+    }
+    
+    void remove(const key_type& key)
+    {
+        _on_shard(key, [&](shard_type& tree) {
+            tree.remove(key);
+        });
+    }
+    
+    bool find(const key_type& key, value_type& value)
+    {
+        return _on_shard(key, [&](shard_type& tree) {
+            return tree.find(key, value);
+        });
+    }
+    
+    size_t size()
+    {
+        size_t total = 0;
+        for (size_t s : shard_sizes()) {
+            total += s;
+        }
+        return total;
+    }
+    
+    bool empty()
+    {
+        return size() == 0;
+    }
+    
+    size_t shard_count() const
+    {
+        return _shards.size();
+    }
+    
+    // all shards are locked at once, so no element is counted twice in a move
+    std::vector<size_t> shard_sizes()
+    {
+        std::vector<shared_lock<bravo_rw_lock>> locks = _lock_all();
+        std::vector<size_t> sizes;
+        for (auto& s : _shards) {
+            sizes.push_back(s -> tree.size());
+        }
+        return sizes;
+    }
+    
+    // calls f(key, value) for every element in key order
+    template<typename F>
+    void for_each(F f)
+    {
+        std::vector<shared_lock<bravo_rw_lock>> locks = _lock_all();
+        std::vector<element> batch;
+        
+        for (auto& s : _shards) {
+            auto cursor = s -> tree.scan();
+            while (!cursor.done()) {
+                batch.clear();
+                cursor.next(scan_batch, batch);
+                for (auto& el : batch) {
+                    f(el.first, el.second);
+                }
+            }
+        }
+    }
+    
+    /*
+     Moves the shard bounds to the current key quantiles, so every shard
+     ends up with about the same number of elements. Bounds go one at a
+     time, and only the keys between a bound's old and new place move,
+     with just the two shards on its sides locked. Bounds moving down go
+     first from the left, then bounds moving up from the right, so the
+     bounds stay sorted after every step.
+    */
+    void rebalance()
+    {
+        std::lock_guard<std::mutex> relayout(_relayout);
+        
+        std::vector<key_type> keys;
+        std::vector<element> batch;
+        for (auto& s : _shards) {
+            auto cursor = s -> tree.scan();
+            while (!cursor.done()) {
+                batch.clear();
+                cursor.next(scan_batch, batch);
+                for (auto& el : batch) {
+                    keys.push_back(el.first);
+                }
+            }
+        }
+        _grown.store(0, std::memory_order_relaxed);
+        _relayout_at.store(std::max<size_t>(size_t(relayout_min), keys.size()), std::memory_order_relaxed);
+        // too few keys for one per shard
+        if (keys.size() < _shards.size())
+            return;
+        
+        std::vector<key_type> target;
+        for (size_t i = 1; i < _shards.size(); i++) {
+            target.push_back(keys[keys.size() * i / _shards.size()]);
+        }
+        for (size_t i = 0; i < target.size(); i++) {
+            if (i >= _used.load(std::memory_order_relaxed) || target[i] < _bounds[i])
+                _move_bound(i, target[i]);
+        }
+        for (size_t i = target.size(); i-- > 0;) {
+            if (_bounds[i] < target[i])
+                _move_bound(i, target[i]);
+        }
+    }
+    
+private:
+    static const size_t scan_batch = 256;
+    static const size_t relayout_min = 1024;
+    
+    size_t _index(const key_type& key) const
+    {
+        auto end = _bounds.begin() + _used.load(std::memory_order_acquire);
+        return std::upper_bound(_bounds.begin(), end, key) - _bounds.begin();
+    }
+    
+    // the caller holds shard i's lock, which keeps both of its bounds in place
+    bool _holds(size_t i, const key_type& key) const
+    {
+        return (i == 0 || !(key < _bounds[i - 1])) &&
+            (i >= _used.load(std::memory_order_acquire) || key < _bounds[i]);
+    }
+    
+    // f(tree) on the shard of key, retried if a bound moved before the shard was locked
+    template<typename F>
+    auto _on_shard(const key_type& key, F f)
+    {
+        while (true) {
+            size_t i;
+            {
+                shared_lock<bravo_rw_lock> layout(_layout);
+                i = _index(key);
+            }
+            shard& s = *_shards[i];
+            shared_lock<bravo_rw_lock> lock(s.lock);
+            if (_holds(i, key))
+                return f(s.tree);
+        }
+    }
+    
+    std::vector<shared_lock<bravo_rw_lock>> _lock_all()
+    {
+        std::vector<shared_lock<bravo_rw_lock>> locks;
+        for (auto& s : _shards) {
+            locks.emplace_back(s -> lock);
+        }
+        return locks;
+    }
+    
+    /*
+     Moves bound i, the one between shards i and i + 1, to key; an unset
+     bound counts as past every key and becomes set. The caller holds
+     _relayout, so no other bound moves meanwhile.
+    */
+    void _move_bound(size_t i, const key_type& key)
+    {
+        shard& lower = *_shards[i];
+        shard& upper = *_shards[i + 1];
+        unique_lock<bravo_rw_lock> lower_lock(lower.lock);
+        unique_lock<bravo_rw_lock> upper_lock(upper.lock);
+        
+        bool unset = i >= _used.load(std::memory_order_relaxed);
+        if (unset || key < _bounds[i])
+            _move(lower.tree, upper.tree, key, unset ? nullptr : &_bounds[i]);
+        else
+            _move(upper.tree, lower.tree, _bounds[i], &key);
+        
+        unique_lock<bravo_rw_lock> layout(_layout);
+        _bounds[i] = key;
+        if (unset)
+            _used.store(i + 1, std::memory_order_release);
+    }
+    
+    // moves the keys in [from, *to) of src to dst, to null for no upper end
+    static void _move(shard_type& src, shard_type& dst, const key_type& from, const key_type* to)
+    {
+        std::vector<element> moved;
+        auto cursor = src.scan(from);
+        while (!cursor.done() && (!to || moved.empty() || moved.back().first < *to)) {
+            cursor.next(scan_batch, moved);
+        }
+        while (to && !moved.empty() && !(moved.back().first < *to)) {
+            moved.pop_back();
+        }
+        
+        std::vector<batch_op> added, removed;
+        for (auto& el : moved) {
+            added.push_back(batch_op(batch_op::insert_op, el.first, el.second));
+            removed.push_back(batch_op(batch_op::remove_op, el.first));
+        }
+        dst.apply_batch(added);
+        src.apply_batch(removed);
+    }
+};
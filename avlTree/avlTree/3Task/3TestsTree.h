@@ -1,19 +1,28 @@
 #pragma once
 
+#include <atomic>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "test_runner.h"
 #include "MediumGrainedTree.h"
+#include "OptimisticTree.h"
+#include "LockFreeTree.h"
+#include "SkipList.h"
+#include "instrumented_lock.h"
+#include "version_lock.h"
+#include "sharded_counter.h"
+#include "thread_pool.h"
 
 using namespace std;
 
 
 void MediumGrainedTestAdd()
 {
-    avl_tree<char, char> tree;
+    avl_tree<int, int> tree;
     vector<thread> threads;
     int thNum = 4;
     int elNum = 1000;
@@ -23,7 +32,7 @@ void MediumGrainedTestAdd()
     for (int i = 0; i < thNum / 2; i++) {
         threads.push_back(thread( [&] (int th) {
             for (int j = 0; j < elNum; j++) {
-                tree.insert(i * j * thNum, i * j * thNum);
+                tree.insert(j * thNum + th, j);
             }
         }, i));
     }
@@ -41,7 +50,7 @@ void MediumGrainedTestAdd()
 
 void MediumGrainedTestRemove()
 {
-    avl_tree<char, char> tree;
+    avl_tree<int, int> tree;
     vector<thread> threads;
     int thNum = 4;
     int elNum = 1000;
@@ -49,7 +58,7 @@ void MediumGrainedTestRemove()
     for (int i = 0; i < thNum / 2; i++) {
         threads.push_back(thread( [&] (int th) {
             for (int j = 0; j < elNum; j++) {
-                tree.insert(i * j * thNum, i * j * thNum);
+                tree.insert(j * thNum + th, j);
             }
         }, i));
     }
@@ -61,10 +70,11 @@ void MediumGrainedTestRemove()
     auto startTime = chrono::high_resolution_clock::now();
     
     
+    threads.clear();
     for (int i = 0; i < thNum; i++){
-        threads[i] = thread( [&] (int th) {
+        threads.emplace_back( [&] (int th) {
             for (int j = 0; j < elNum; j++) {
-                tree.remove(i * j * thNum);
+                tree.remove(j * thNum + th);
             }
         }, i);
     }
@@ -76,12 +86,12 @@ void MediumGrainedTestRemove()
     auto endTime = chrono::high_resolution_clock::now();
     auto time = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
     cout << (double)time.count() / 1000.0 << endl;
-
+    ASSERT_EQUAL(tree.empty(), true);
 }
 
 void MediumGrainedTestAddAndRemove() {
     
-    avl_tree<char, char> tree;
+    avl_tree<int, int> tree;
     vector<thread> threads;
     int thNum = 4;
     int elNum = 1000;
@@ -91,12 +101,15 @@ void MediumGrainedTestAddAndRemove() {
     for (int i = 0; i < thNum / 2; i++) {
         threads.push_back(thread( [&] (int th) {
             for (int j = 0; j < elNum; j++) {
-                tree.insert(i * j * thNum, i * j * thNum);
+                tree.insert(j * thNum + th, j);
             }
         }, i));
         threads.push_back(thread( [&] (int th) {
+            // a key may not be there yet, the remover waits for it
             for (int j = 0; j < elNum; j++) {
-                tree.remove(i * j * thNum);
+                while (!tree.remove(j * thNum + th)) {
+                    this_thread::yield();
+                }
             }
         }, i));
     }
@@ -112,10 +125,913 @@ void MediumGrainedTestAddAndRemove() {
     ASSERT_EQUAL(tree.empty(), true);
 }
 
+// the same workload for every map with the avl_tree interface, so the timings compare
+template<typename Map>
+void ConcurrentReadUnderWrite()
+{
+    Map tree;
+    vector<thread> threads;
+    int thNum = 4;
+    int elNum = 2000;
+    // failed checks on the worker threads, asserted after the join
+    atomic<bool> consistent(true);
+    
+    auto startTime = chrono::high_resolution_clock::now();
+    
+    // writers fill disjoint key ranges while readers look up keys of all ranges
+    for (int i = 0; i < thNum; i++) {
+        threads.push_back(thread( [&tree, elNum] (int th) {
+            for (int j = 0; j < elNum; j++) {
+                tree.insert(th * elNum + j, j);
+            }
+        }, i));
+        threads.push_back(thread( [&tree, &consistent, elNum, thNum] (int th) {
+            for (int j = 0; j < elNum; j++) {
+                int key = (j * 7 + th) % (thNum * elNum);
+                auto it = tree.find(key);
+                if (it != tree.end() && (it.key() != key || it.value() != key % elNum))
+                    consistent = false;
+            }
+        }, i));
+    }
+    for (auto& i : threads) {
+        i.join();
+    }
+    ASSERT_EQUAL(consistent.load(), true);
+    ASSERT_EQUAL(tree.size(), size_t(thNum * elNum));
+    
+    threads.clear();
+    for (int i = 0; i < thNum; i++) {
+        threads.push_back(thread( [&tree, &consistent, elNum] (int th) {
+            for (int j = 0; j < elNum; j += 2) {
+                if (!tree.remove(th * elNum + j))
+                    consistent = false;
+            }
+        }, i));
+        threads.push_back(thread( [&tree, &consistent] () {
+            int prev = -1;
+            for (auto it = tree.begin(); it != tree.end(); ++it) {
+                if (it.key() <= prev)
+                    consistent = false;
+                prev = it.key();
+            }
+        }));
+    }
+    for (auto& i : threads) {
+        i.join();
+    }
+    ASSERT_EQUAL(consistent.load(), true);
+    
+    auto endTime = chrono::high_resolution_clock::now();
+    auto time = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+    cout << (double)time.count() / 1000.0 << endl;
+    
+    ASSERT_EQUAL(tree.size(), thNum * elNum / 2);
+    int expected = 1;
+    for (auto it = tree.begin(); it != tree.end(); ++it, expected += 2) {
+        ASSERT_EQUAL(it.key(), expected);
+    }
+    ASSERT_EQUAL(expected, thNum * elNum + 1);
+}
+
+void MediumGrainedTestReadUnderWrite()
+{
+    ConcurrentReadUnderWrite<avl_tree<int, int>>();
+}
+
+void MediumGrainedTestPop()
+{
+    avl_tree<int, int> tree;
+    for (int i = 0; i < 100; i++) {
+        tree.insert((i * 37) % 100, i);
+    }
+    
+    int key = 0, value = 0;
+    for (int i = 0; i < 10; i++) {
+        ASSERT_EQUAL(tree.pop_min(key, value), true);
+        ASSERT_EQUAL(key, i);
+        ASSERT_EQUAL(tree.pop_max(key, value), true);
+        ASSERT_EQUAL(key, 99 - i);
+    }
+    ASSERT_EQUAL(tree.size(), 80u);
+    
+    ASSERT_EQUAL(tree.try_pop_min_if([](int k, int) { return k > 10; }, key, value), false);
+    ASSERT_EQUAL(tree.try_pop_min_if([](int k, int) { return k == 10; }, key, value), true);
+    ASSERT_EQUAL(key, 10);
+    
+    while (tree.pop_min(key, value)) {}
+    ASSERT_EQUAL(tree.empty(), true);
+}
+
+void MediumGrainedNodeSize()
+{
+    cout << "avl_tree<int, int> node: " << avl_tree<int, int>::node_size() << endl;
+    
+    // the node lock is a single 4-byte word, and height and the deleted flag fit in its padding
+    ASSERT_EQUAL(sizeof(RWSpinLock), sizeof(uint32_t));
+    struct payload { int key; int value; SmartPointer<int> left; SmartPointer<int> right; uint32_t lock; };
+    ASSERT_EQUAL((avl_tree<int, int>::node_size()) <= sizeof(payload), true);
+}
+
+struct tree_node_lock {
+    static const char* name() {
+        return "MediumGrainedTree::node::mut";
+    }
+};
+
+void MediumGrainedInstrumented()
+{
+    using lock_type = instrumented_lock<RWSpinLock, tree_node_lock>;
+    avl_tree<int, int, lock_type> tree;
+    for (int i = 0; i < 100; i++) {
+        tree.insert(i, i);
+    }
+    
+    int key = 0, value = 0;
+    while (tree.pop_min(key, value)) {}
+    ASSERT_EQUAL(tree.empty(), true);
+    
+    ASSERT_EQUAL(lock_type::stats().wait.count() > 0, true);
+    ASSERT_EQUAL(lock_type::stats().hold.count(), lock_type::stats().wait.count());
+    lock_type::stats().dump(cout);
+}
+
+void MediumGrainedVersionLock()
+{
+    // the wider version costs at most one more word per node
+    ASSERT_EQUAL(sizeof(version_lock), sizeof(uint64_t));
+    ASSERT_EQUAL((avl_tree<int, int, version_lock>::node_size()) <= (avl_tree<int, int>::node_size()) + sizeof(uint64_t), true);
+    
+    version_lock lock;
+    auto stamp = lock.read_stamp();
+    lock.lock_shared();
+    lock.unlock_shared();
+    ASSERT_EQUAL(lock.validate(stamp), true);
+    lock.lock();
+    ASSERT_EQUAL(lock.try_lock_shared(), false);
+    ASSERT_EQUAL(lock.validate(stamp), false);
+    lock.unlock();
+    ASSERT_EQUAL(lock.validate(stamp), false);
+    ASSERT_EQUAL(lock.validate(lock.read_stamp()), true);
+    
+    // a full reader count turns readers away instead of spilling into the writer bit
+    int readers = 0;
+    while (lock.try_lock_shared()) {
+        readers++;
+    }
+    ASSERT_EQUAL(readers, (1 << 15) - 1);
+    ASSERT_EQUAL(lock.try_lock(), false);
+    stamp = lock.read_stamp();
+    for (int i = 0; i < readers; i++) {
+        lock.unlock_shared();
+    }
+    ASSERT_EQUAL(lock.validate(stamp), true);
+    ASSERT_EQUAL(lock.try_lock(), true);
+    lock.unlock();
+    
+    ConcurrentReadUnderWrite<avl_tree<int, int, version_lock>>();
+}
+
+template<typename Tree>
+void ConcurrentPop(Tree& tree)
+{
+    int thNum = 4;
+    int elNum = 20000;
+    for (int i = 0; i < elNum; i++) {
+        tree.insert((i * 7919) % elNum, i);
+    }
+    
+    vector<atomic<int>> taken(elNum);
+    atomic<int> badKeys = {0};
+    vector<thread> threads;
+    for (int i = 0; i < thNum; i++) {
+        threads.emplace_back([&tree, &taken, &badKeys, elNum] (int th) {
+            int key = 0, value = 0;
+            while (th % 2 ? tree.pop_max(key, value) : tree.pop_min(key, value)) {
+                if (key < 0 || key >= elNum) {
+                    badKeys++;
+                    continue;
+                }
+                taken[key]++;
+            }
+        }, i);
+    }
+    for (auto& i : threads) {
+        i.join();
+    }
+    
+    ASSERT_EQUAL(badKeys.load(), 0);
+    int once = 0;
+    for (auto& t : taken) {
+        once += t.load() == 1;
+    }
+    ASSERT_EQUAL(once, elNum);
+    ASSERT_EQUAL(tree.empty(), true);
+}
+
+void MediumGrainedConcurrentPop()
+{
+    avl_tree<int, int> strict;
+    ConcurrentPop(strict);
+    avl_tree<int, int> relaxed(true);
+    ConcurrentPop(relaxed);
+}
+
+void MediumGrainedRelaxed()
+{
+    avl_tree<int, int> tree(true);
+    vector<thread> threads;
+    int thNum = 4;
+    int elNum = 2000;
+    
+    atomic<bool> removed(true);
+    
+    auto startTime = chrono::high_resolution_clock::now();
+    
+    // ascending runs are the worst case for a tree that rebalances late
+    for (int i = 0; i < thNum; i++) {
+        threads.push_back(thread( [&tree, &removed, elNum] (int th) {
+            for (int j = 0; j < elNum; j++) {
+                tree.insert(th * elNum + j, j);
+            }
+            for (int j = 1; j < elNum; j += 2) {
+                if (!tree.remove(th * elNum + j))
+                    removed = false;
+            }
+        }, i));
+    }
+    for (auto& i : threads) {
+        i.join();
+    }
+    ASSERT_EQUAL(removed.load(), true);
+    tree.wait_rebalanced();
+    
+    auto endTime = chrono::high_resolution_clock::now();
+    auto time = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+    cout << (double)time.count() / 1000.0 << endl;
+    
+    ASSERT_EQUAL(tree.balanced(), true);
+    ASSERT_EQUAL(tree.size(), size_t(thNum * elNum / 2));
+    int expected = 0;
+    for (auto it = tree.begin(); it != tree.end(); ++it, expected += 2) {
+        ASSERT_EQUAL(it.key(), expected);
+        ASSERT_EQUAL(it.value(), expected % elNum);
+    }
+    ASSERT_EQUAL(expected, thNum * elNum);
+}
+
+void MediumGrainedSnapshotScan()
+{
+    avl_tree<int, int> tree;
+    vector<thread> threads;
+    int thNum = 4;
+    int elNum = 300;
+    atomic<bool> stop(false);
+    atomic<bool> consistent(true);
+    
+    // every writer fills and empties its own range in ascending order, so
+    // at any moment each range holds a run of consecutive keys
+    for (int i = 0; i < thNum; i++) {
+        threads.push_back(thread( [&tree, &consistent, elNum] (int th) {
+            for (int round = 0; round < 10; round++) {
+                for (int j = 0; j < elNum; j++) {
+                    tree.insert(th * elNum + j, j);
+                }
+                for (int j = 0; j < elNum; j++) {
+                    if (!tree.remove(th * elNum + j))
+                        consistent = false;
+                }
+            }
+        }, i));
+    }
+    
+    thread scanner([&tree, &stop, &consistent, thNum, elNum] () {
+        while (!stop) {
+            vector<vector<int>> ranges(thNum);
+            tree.snapshot_scan(0, thNum * elNum, [&ranges, &consistent, elNum](int key, int value) {
+                if (value != key % elNum)
+                    consistent = false;
+                ranges[key / elNum].push_back(value);
+            });
+            for (auto& range : ranges) {
+                for (size_t j = 1; j < range.size(); j++) {
+                    if (range[j] != range[j - 1] + 1)
+                        consistent = false;
+                }
+            }
+        }
+    });
+    
+    for (auto& i : threads) {
+        i.join();
+    }
+    stop = true;
+    scanner.join();
+    ASSERT_EQUAL(consistent.load(), true);
+    
+    for (int i = 0; i < 10; i++) {
+        tree.insert(i, i);
+    }
+    int expected = 3;
+    tree.snapshot_scan(3, 7, [&expected](int key, int) {
+        ASSERT_EQUAL(key, expected);
+        expected++;
+    });
+    ASSERT_EQUAL(expected, 7);
+}
+
+// each key goes in only after the one before it is found, by the other thread
+void MediumGrainedSnapshotOrder()
+{
+    avl_tree<int, int> tree;
+    int elNum = 2000;
+    atomic<bool> stop(false);
+    atomic<bool> consistent(true);
+    
+    vector<thread> threads;
+    for (int i = 0; i < 2; i++) {
+        threads.push_back(thread( [&tree, elNum] (int th) {
+            for (int j = th; j < elNum; j += 2) {
+                while (j > 0 && tree.find(j - 1) == tree.end()) {
+                    this_thread::yield();
+                }
+                tree.insert(j, j);
+            }
+        }, i));
+    }
+    
+    thread scanner([&tree, &stop, &consistent, elNum] () {
+        while (!stop) {
+            int expected = 0;
+            tree.snapshot_scan(0, elNum, [&expected, &consistent](int key, int) {
+                if (key != expected)
+                    consistent = false;
+                expected++;
+            });
+        }
+    });
+    
+    for (auto& i : threads) {
+        i.join();
+    }
+    stop = true;
+    scanner.join();
+    ASSERT_EQUAL(consistent.load(), true);
+    ASSERT_EQUAL(tree.size(), size_t(elNum));
+}
+
+void MediumGrainedParallelInsert()
+{
+    int elNum = 100000;
+    vector<pair<int, int>> items;
+    for (int i = 0; i < elNum; i++) {
+        items.emplace_back((i * 7919) % elNum, i);
+    }
+    // duplicates of the first thousand keys, the earlier pairs must win
+    for (int i = 0; i < 1000; i++) {
+        items.emplace_back((i * 7919) % elNum, -1);
+    }
+    
+    avl_tree<int, int> tree;
+    auto startTime = chrono::high_resolution_clock::now();
+    tree.parallel_insert(items.begin(), items.end(), 4);
+    auto endTime = chrono::high_resolution_clock::now();
+    auto time = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+    cout << (double)time.count() / 1000.0 << endl;
+    
+    ASSERT_EQUAL(tree.size(), size_t(elNum));
+    int expected = 0;
+    for (auto it = tree.begin(); it != tree.end(); ++it, expected++) {
+        ASSERT_EQUAL(it.key(), expected);
+        ASSERT_EQUAL((it.value() * 7919) % elNum, expected);
+    }
+    ASSERT_EQUAL(expected, elNum);
+    
+    // into a tree that already holds the even keys of the range
+    vector<pair<int, int>> more;
+    for (int i = 0; i < 2 * elNum; i++) {
+        more.emplace_back(elNum + i, i % 2 ? i : -1);
+    }
+    avl_tree<int, int> half;
+    for (int i = 0; i < 2 * elNum; i += 2) {
+        half.insert(elNum + i, i);
+    }
+    half.parallel_insert(more.begin(), more.end(), 4);
+    ASSERT_EQUAL(half.size(), size_t(2 * elNum));
+    expected = elNum;
+    for (auto it = half.begin(); it != half.end(); ++it, expected++) {
+        ASSERT_EQUAL(it.key(), expected);
+        ASSERT_EQUAL(it.value(), expected - elNum);
+    }
+}
+
+void MediumGrainedUpsert()
+{
+    avl_tree<int, int> tree;
+    vector<thread> threads;
+    int thNum = 4;
+    int keyNum = 100;
+    int rounds = 1000;
+    
+    // counters by key, the first upsert of a key inserts it
+    atomic<int> inserted(0);
+    for (int i = 0; i < thNum; i++) {
+        threads.push_back(thread( [&tree, &inserted, keyNum, rounds] () {
+            for (int r = 0; r < rounds; r++) {
+                for (int k = 0; k < keyNum; k++) {
+                    if (tree.upsert(k, [](int& count) { count++; }))
+                        inserted++;
+                }
+            }
+        }));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    threads.clear();
+    
+    ASSERT_EQUAL(inserted.load(), keyNum);
+    ASSERT_EQUAL(tree.size(), size_t(keyNum));
+    for (int k = 0; k < keyNum; k++) {
+        ASSERT_EQUAL(tree.find(k).value(), thNum * rounds);
+    }
+    
+    for (int i = 0; i < thNum; i++) {
+        threads.push_back(thread( [&tree, keyNum] () {
+            for (int k = 0; k < 2 * keyNum; k++) {
+                tree.compute(k, [](const int* old) { return old ? *old + 1 : 1; });
+            }
+        }));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    
+    ASSERT_EQUAL(tree.size(), size_t(2 * keyNum));
+    for (int k = 0; k < 2 * keyNum; k++) {
+        ASSERT_EQUAL(tree.find(k).value(), k < keyNum ? thNum * rounds + thNum : thNum);
+    }
+    ASSERT_EQUAL(tree.compute(0, [](const int* old) { return -*old; }), -(thNum * rounds + thNum));
+}
+
+void MediumGrainedParallelReduce()
+{
+    avl_tree<int, int> tree;
+    int elNum = 20000;
+    for (int i = 0; i < elNum; i++) {
+        tree.insert(i, i);
+    }
+    
+    // keys arrive in order, so every snapshot holds 0..count-1
+    thread writer([&tree, elNum]() {
+        for (int i = elNum; i < 2 * elNum; i++) {
+            tree.insert(i, i);
+        }
+    });
+    for (int round = 0; round < 5; round++) {
+        auto res = tree.parallel_reduce(make_pair(0LL, 0LL),
+                                        [](int key, int) { return make_pair(1LL, (long long)key); },
+                                        [](pair<long long, long long> a, pair<long long, long long> b) {
+                                            return make_pair(a.first + b.first, a.second + b.second);
+                                        }, 4);
+        ASSERT_EQUAL(res.first >= elNum, true);
+        ASSERT_EQUAL(res.second, res.first * (res.first - 1) / 2);
+    }
+    writer.join();
+    
+    atomic<long long> sum(0);
+    tree.parallel_for_each([&sum](int key, int value) { sum += key - value; }, 4);
+    ASSERT_EQUAL(sum.load(), 0LL);
+    
+    avl_tree<int, int> empty;
+    ASSERT_EQUAL(empty.parallel_reduce(7, [](int, int value) { return value; }, [](int a, int b) { return a + b; }), 7);
+}
+
+// sums lo..hi-1 by splitting in halves, so forks nest inside tasks
+long long PoolSum(thread_pool& pool, long long lo, long long hi)
+{
+    if (hi - lo <= 1000) {
+        long long sum = 0;
+        for (long long i = lo; i < hi; i++) {
+            sum += i;
+        }
+        return sum;
+    }
+    long long mid = lo + (hi - lo) / 2;
+    long long left = 0;
+    thread_pool::task_group group(pool);
+    group.fork([&pool, &left, lo, mid] { left = PoolSum(pool, lo, mid); });
+    long long right = PoolSum(pool, mid, hi);
+    group.join();
+    return left + right;
+}
+
+void ThreadPoolTest()
+{
+    thread_pool pool(4);
+    long long n = 1000000;
+    ASSERT_EQUAL(PoolSum(pool, 0, n), n * (n - 1) / 2);
+    
+    // a pool of one worker must not deadlock on nested joins either
+    thread_pool single(1);
+    ASSERT_EQUAL(PoolSum(single, 0, n), n * (n - 1) / 2);
+    
+    vector<atomic<int>> hits(1000);
+    for (auto& h : hits) {
+        h = 0;
+    }
+    pool.parallel_for(hits.size(), [&hits](size_t i) { hits[i]++; });
+    for (auto& h : hits) {
+        ASSERT_EQUAL(h.load(), 1);
+    }
+    
+    // tasks submitted from several outside threads all run
+    atomic<int> done(0);
+    vector<thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.push_back(thread( [&pool, &done] () {
+            thread_pool::task_group group(pool);
+            for (int j = 0; j < 1000; j++) {
+                group.fork([&done] { done++; });
+            }
+        }));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    ASSERT_EQUAL(done.load(), 4000);
+    
+    // join waits for every task, then rethrows what one of them threw
+    atomic<int> ran(0);
+    bool caught = false;
+    try {
+        thread_pool::task_group group(pool);
+        for (int j = 0; j < 100; j++) {
+            group.fork([&ran, j] {
+                ran++;
+                if (j % 10 == 0) {
+                    throw runtime_error("task failed");
+                }
+            });
+        }
+        group.join();
+    } catch (const runtime_error&) {
+        caught = true;
+    }
+    ASSERT_EQUAL(caught, true);
+    ASSERT_EQUAL(ran.load(), 100);
+    
+    caught = false;
+    try {
+        pool.parallel_for(8, [](size_t i) {
+            if (i == 5) {
+                throw runtime_error("job failed");
+            }
+        });
+    } catch (const runtime_error&) {
+        caught = true;
+    }
+    ASSERT_EQUAL(caught, true);
+    
+    // a throwing submitted task leaves its worker running
+    for (size_t i = 0; i < pool.size(); i++) {
+        pool.submit([] { throw runtime_error("dropped"); });
+    }
+    done = 0;
+    pool.parallel_for(1000, [&done](size_t) { done++; });
+    ASSERT_EQUAL(done.load(), 1000);
+}
+
+void ShardedCounterTest()
+{
+    sharded_counter counter;
+    vector<thread> threads;
+    int thNum = 4;
+    int elNum = 10000;
+    
+    for (int i = 0; i < thNum; i++) {
+        threads.push_back(thread( [&counter, elNum] () {
+            for (int j = 0; j < elNum; j++) {
+                counter.increment();
+            }
+            for (int j = 0; j < elNum / 2; j++) {
+                counter.decrement();
+            }
+        }));
+    }
+    for (auto& i : threads) {
+        i.join();
+    }
+    
+    size_t exact = thNum * elNum / 2;
+    ASSERT_EQUAL(counter.sum(), exact);
+    size_t slack = thNum * sharded_counter::flush_every;
+    ASSERT_EQUAL(counter.approx() + slack >= exact && counter.approx() <= exact + slack, true);
+    
+    avl_tree<int, int> tree;
+    for (int i = 0; i < 1000; i++) {
+        tree.insert(i, i);
+    }
+    ASSERT_EQUAL(tree.size(), 1000u);
+    ASSERT_EQUAL(tree.approx_size() <= 1000 && tree.approx_size() + sharded_counter::flush_every >= 1000, true);
+}
+
+void OptimisticTreeTest()
+{
+    optimistic_avl_tree<int, int> tree;
+    for (int i = 0; i < 100; i++) {
+        ASSERT_EQUAL(tree.insert((i * 37) % 100, i), true);
+    }
+    ASSERT_EQUAL(tree.insert(5, 0), false);
+    ASSERT_EQUAL(tree.size(), 100u);
+    
+    // even keys go, the odd ones stay, partly behind routing nodes
+    for (int i = 0; i < 100; i += 2) {
+        ASSERT_EQUAL(tree.remove(i), true);
+    }
+    ASSERT_EQUAL(tree.remove(0), false);
+    
+    int value = 0;
+    ASSERT_EQUAL(tree.find(4, value), false);
+    ASSERT_EQUAL(tree.find(37, value), true);
+    ASSERT_EQUAL(value, 1);
+    
+    int expected = 1;
+    tree.for_each([&expected](int key, int) {
+        ASSERT_EQUAL(key, expected);
+        expected += 2;
+    });
+    ASSERT_EQUAL(expected, 101);
+    ASSERT_EQUAL(tree.size(), 50u);
+}
+
+void OptimisticTreeReadUnderWrite()
+{
+    optimistic_avl_tree<int, int> tree;
+    vector<thread> threads;
+    int thNum = 4;
+    int elNum = 2000;
+    
+    for (int i = 0; i < elNum; i += 2) {
+        tree.insert(i, i);
+    }
+    atomic<bool> found(true);
+    
+    auto startTime = chrono::high_resolution_clock::now();
+    
+    // writers churn the odd keys, readers must always see every even one
+    for (int i = 0; i < thNum; i++) {
+        threads.push_back(thread( [&tree, elNum] (int th) {
+            for (int j = 0; j < 5 * elNum; j++) {
+                int key = 2 * ((j * 7 + th) % (elNum / 2)) + 1;
+                if ((j + th) % 2)
+                    tree.insert(key, key);
+                else
+                    tree.remove(key);
+            }
+        }, i));
+        threads.push_back(thread( [&tree, &found, elNum] (int th) {
+            for (int j = 0; j < 5 * elNum; j++) {
+                int key = 2 * ((j * 13 + th) % (elNum / 2));
+                int value = -1;
+                if (!tree.find(key, value) || value != key)
+                    found = false;
+            }
+        }, i));
+    }
+    for (auto& i : threads) {
+        i.join();
+    }
+    ASSERT_EQUAL(found.load(), true);
+    
+    auto endTime = chrono::high_resolution_clock::now();
+    auto time = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+    cout << (double)time.count() / 1000.0 << endl;
+    
+    size_t count = 0;
+    int prev = -1;
+    tree.for_each([&count, &prev](int key, int value) {
+        ASSERT_EQUAL(key > prev, true);
+        ASSERT_EQUAL(value, key);
+        prev = key;
+        count++;
+    });
+    ASSERT_EQUAL(count, tree.size());
+}
+
+void LockFreeTreeTest()
+{
+    lock_free_bst<int, int> tree;
+    for (int i = 0; i < 100; i++) {
+        ASSERT_EQUAL(tree.insert((i * 37) % 100, i), true);
+    }
+    ASSERT_EQUAL(tree.insert(5, 0), false);
+    ASSERT_EQUAL(tree.size(), 100u);
+    
+    for (int i = 0; i < 100; i += 2) {
+        ASSERT_EQUAL(tree.remove(i), true);
+    }
+    ASSERT_EQUAL(tree.remove(0), false);
+    
+    int value = 0;
+    ASSERT_EQUAL(tree.find(4, value), false);
+    ASSERT_EQUAL(tree.find(37, value), true);
+    ASSERT_EQUAL(value, 1);
+    
+    int expected = 1;
+    tree.for_each([&expected](int key, int) {
+        ASSERT_EQUAL(key, expected);
+        expected += 2;
+    });
+    ASSERT_EQUAL(expected, 101);
+    ASSERT_EQUAL(tree.size(), 50u);
+    
+    ASSERT_EQUAL(tree.find(4) == tree.end(), true);
+    ASSERT_EQUAL(*tree.find(37), 1);
+    ASSERT_EQUAL(tree.lower_bound(40).key(), 41);
+    ASSERT_EQUAL(tree.lower_bound(41).key(), 41);
+    ASSERT_EQUAL(tree.upper_bound(41).key(), 43);
+    ASSERT_EQUAL(tree.upper_bound(99) == tree.end(), true);
+    
+    auto it = tree.find(41);
+    ASSERT_EQUAL((--it).key(), 39);
+    ASSERT_EQUAL((--tree.begin()) == tree.end(), true);
+    
+    expected = 1;
+    for (auto i = tree.begin(); i != tree.end(); ++i, expected += 2) {
+        ASSERT_EQUAL(i.key(), expected);
+    }
+    ASSERT_EQUAL(expected, 101);
+    
+    lock_free_bst<int, int> empty;
+    ASSERT_EQUAL(empty.begin() == empty.end(), true);
+    ASSERT_EQUAL(empty.lower_bound(0) == empty.end(), true);
+}
+
+void LockFreeTreeReadUnderWrite()
+{
+    lock_free_bst<int, int> tree;
+    vector<thread> threads;
+    // more threads than cores, where a preempted lock holder would stall everyone
+    int thNum = 2 * max(1u, thread::hardware_concurrency());
+    int elNum = 2000;
+    
+    for (int i = 0; i < elNum; i += 2) {
+        tree.insert(i, i);
+    }
+    atomic<bool> found(true);
+    
+    auto startTime = chrono::high_resolution_clock::now();
+    
+    for (int i = 0; i < thNum; i++) {
+        threads.push_back(thread( [&tree, elNum] (int th) {
+            for (int j = 0; j < 5 * elNum; j++) {
+                int key = 2 * ((j * 7 + th) % (elNum / 2)) + 1;
+                if ((j + th) % 2)
+                    tree.insert(key, key);
+                else
+                    tree.remove(key);
+            }
+        }, i));
+        threads.push_back(thread( [&tree, &found, elNum] (int th) {
+            for (int j = 0; j < 5 * elNum; j++) {
+                int key = 2 * ((j * 13 + th) % (elNum / 2));
+                int value = -1;
+                if (!tree.find(key, value) || value != key)
+                    found = false;
+            }
+        }, i));
+    }
+    for (auto& i : threads) {
+        i.join();
+    }
+    ASSERT_EQUAL(found.load(), true);
+    
+    auto endTime = chrono::high_resolution_clock::now();
+    auto time = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+    cout << (double)time.count() / 1000.0 << endl;
+    
+    size_t count = 0;
+    int prev = -1;
+    tree.for_each([&count, &prev](int key, int value) {
+        ASSERT_EQUAL(key > prev, true);
+        ASSERT_EQUAL(value, key);
+        prev = key;
+        count++;
+    });
+    ASSERT_EQUAL(count, tree.size());
+}
+
+void LockFreeTreeTestReadUnderWrite()
+{
+    ConcurrentReadUnderWrite<lock_free_bst<int, int>>();
+}
+
+void SkipListTest()
+{
+    skiplist_map<int, int> list;
+    for (int i = 0; i < 100; i++) {
+        auto it = list.insert((i * 37) % 100, i);
+        ASSERT_EQUAL(it.key(), (i * 37) % 100);
+    }
+    // 37 * 65 % 100 == 5, an existing key keeps its value
+    ASSERT_EQUAL(list.insert(5, 0).value(), 65);
+    ASSERT_EQUAL(list.size(), 100u);
+    
+    for (int i = 0; i < 100; i += 2) {
+        ASSERT_EQUAL(list.remove(i), true);
+    }
+    ASSERT_EQUAL(list.remove(0), false);
+    ASSERT_EQUAL(list.find(4) == list.end(), true);
+    ASSERT_EQUAL(list.find(37).value(), 1);
+    
+    ASSERT_EQUAL(list.lower_bound(40).key(), 41);
+    ASSERT_EQUAL(list.lower_bound(41).key(), 41);
+    ASSERT_EQUAL(list.upper_bound(41).key(), 43);
+    ASSERT_EQUAL(list.lower_bound(100) == list.end(), true);
+    
+    auto it = list.find(41);
+    ASSERT_EQUAL((--it).key(), 39);
+    
+    int expected = 21;
+    list.for_range(20, 30, [&expected](int key, int) {
+        ASSERT_EQUAL(key, expected);
+        expected += 2;
+    });
+    ASSERT_EQUAL(expected, 31);
+    
+    expected = 1;
+    for (auto i = list.begin(); i != list.end(); ++i, expected += 2) {
+        ASSERT_EQUAL(i.key(), expected);
+    }
+    ASSERT_EQUAL(expected, 101);
+}
+
+void SkipListTestReadUnderWrite()
+{
+    ConcurrentReadUnderWrite<skiplist_map<int, int>>();
+}
+
+// the workload of MediumGrainedTestAddAndRemove, so the timings compare
+void SkipListTestAddAndRemove()
+{
+    skiplist_map<int, int> list;
+    vector<thread> threads;
+    int thNum = 4;
+    int elNum = 1000;
+    
+    auto startTime = chrono::high_resolution_clock::now();
+    
+    for (int i = 0; i < thNum / 2; i++) {
+        threads.push_back(thread( [&list, thNum, elNum] (int th) {
+            for (int j = 0; j < elNum; j++) {
+                list.insert(j * thNum + th, j);
+            }
+        }, i));
+        threads.push_back(thread( [&list, thNum, elNum] (int th) {
+            for (int j = 0; j < elNum; j++) {
+                while (!list.remove(j * thNum + th)) {
+                    this_thread::yield();
+                }
+            }
+        }, i));
+    }
+    for (auto& i : threads) {
+        i.join();
+    }
+    
+    auto endTime = chrono::high_resolution_clock::now();
+    auto time = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+    cout << (double)time.count() / 1000.0 << endl;
+    ASSERT_EQUAL(list.empty(), true);
+}
+
 void Test()
 {
     TestRunner tr;
     RUN_TEST(tr, MediumGrainedTestAdd);
     RUN_TEST(tr, MediumGrainedTestRemove);
     RUN_TEST(tr, MediumGrainedTestAddAndRemove);
+    RUN_TEST(tr, MediumGrainedTestReadUnderWrite);
+    RUN_TEST(tr, MediumGrainedTestPop);
+    RUN_TEST(tr, MediumGrainedConcurrentPop);
+    RUN_TEST(tr, MediumGrainedNodeSize);
+    RUN_TEST(tr, MediumGrainedInstrumented);
+    RUN_TEST(tr, MediumGrainedVersionLock);
+    RUN_TEST(tr, MediumGrainedRelaxed);
+    RUN_TEST(tr, MediumGrainedSnapshotScan);
+    RUN_TEST(tr, MediumGrainedSnapshotOrder);
+    RUN_TEST(tr, MediumGrainedParallelInsert);
+    RUN_TEST(tr, MediumGrainedUpsert);
+    RUN_TEST(tr, MediumGrainedParallelReduce);
+    RUN_TEST(tr, ShardedCounterTest);
+    RUN_TEST(tr, ThreadPoolTest);
+    RUN_TEST(tr, OptimisticTreeTest);
+    RUN_TEST(tr, OptimisticTreeReadUnderWrite);
+    RUN_TEST(tr, LockFreeTreeTest);
+    RUN_TEST(tr, LockFreeTreeReadUnderWrite);
+    RUN_TEST(tr, LockFreeTreeTestReadUnderWrite);
+    RUN_TEST(tr, SkipListTest);
+    RUN_TEST(tr, SkipListTestReadUnderWrite);
+    RUN_TEST(tr, SkipListTestAddAndRemove);
 }
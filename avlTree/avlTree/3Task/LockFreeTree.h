@@ -0,0 +1,525 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "epoch_reclaimer.h"
+#include "sharded_counter.h"
+
+/*
+ Lock-free external binary search tree after Natarajan and Mittal, "Fast
+ Concurrent Lock-Free Binary Search Trees". Keys and values live in the
+ leaves, internal nodes only route, so an insert swings one edge to a new
+ internal node and a remove takes out a leaf together with its parent.
+ 
+ Removal marks edges instead of nodes. Flagging the edge to a leaf claims
+ the removal; tagging the edge to its sibling freezes the parent, and one
+ compare-and-swap then hangs the sibling from the nearest ancestor whose
+ edge is untagged. Threads that run into marked edges finish the pending
+ removal first, so no thread ever waits on another. Nodes taken out of
+ the tree are freed through an epoch reclaimer.
+ 
+ Iterators pin the epoch of the thread that made them, as in
+ skiplist_map: they stay valid across removals but must not move to
+ another thread. Leaves have no links to their neighbours, so ++ and --
+ search from the root for the next key. Values live in the leaves and
+ cannot be changed in place.
+*/
+template<typename key_type, typename value_type>
+class lock_free_bst
+{
+    // the leaf at the end of a flagged edge is being removed
+    static constexpr std::uintptr_t flag = 1;
+    // the node at the start of a tagged edge is being removed
+    static constexpr std::uintptr_t tag = 2;
+    static constexpr std::uintptr_t marks = flag | tag;
+    
+    // ranks of the three sentinel keys, above any real key
+    static constexpr int inf0 = 1;
+    static constexpr int inf1 = 2;
+    static constexpr int inf2 = 3;
+    
+    struct node
+    {
+        const key_type _key;
+        const value_type _value;
+        // 0 for a real key
+        const int _rank;
+        // marked pointers; both are null for a leaf and never null for an internal node
+        std::atomic<std::uintptr_t> _left;
+        std::atomic<std::uintptr_t> _right;
+        
+        node(const key_type& key, const value_type& value, int rank, node* left = nullptr, node* right = nullptr)
+        : _key(key), _value(value), _rank(rank),
+        _left(reinterpret_cast<std::uintptr_t>(left)), _right(reinterpret_cast<std::uintptr_t>(right))
+        {}
+        
+        bool leaf() const
+        {
+            return _left.load() == 0;
+        }
+    };
+    
+    // the last untagged edge on the way down runs from ancestor to successor
+    struct seek_record
+    {
+        node* ancestor;
+        node* successor;
+        node* parent;
+        node* leaf;
+    };
+    
+    node* _root;
+    sharded_counter _size;
+    mutable epoch_reclaimer _reclaimer;
+
+public:
+    
+    class Iterator
+    {
+        friend lock_free_bst;
+        node* _node;
+        const lock_free_bst* _owner;
+        
+        void _pin()
+        {
+            if (_owner)
+                _owner -> _reclaimer.enter();
+        }
+        
+        void _unpin()
+        {
+            if (_owner)
+                _owner -> _reclaimer.exit();
+        }
+        
+        void _unpin_end()
+        {
+            _unpin();
+            _owner = nullptr;
+        }
+    
+    public:
+        explicit Iterator(node* n = nullptr, const lock_free_bst* owner = nullptr)
+        : _node(n), _owner(n ? owner : nullptr)
+        {
+            _pin();
+        }
+        
+        Iterator(const Iterator& rhs) : _node(rhs._node), _owner(rhs._owner)
+        {
+            _pin();
+        }
+        
+        Iterator& operator=(const Iterator& rhs)
+        {
+            if (this != &rhs) {
+                _unpin();
+                _node = rhs._node;
+                _owner = rhs._owner;
+                _pin();
+            }
+            return *this;
+        }
+        
+        ~Iterator()
+        {
+            _unpin();
+        }
+        
+        bool operator==(const Iterator& rhs) const
+        {
+            return _node == rhs._node;
+        }
+        
+        bool operator!=(const Iterator& rhs) const
+        {
+            return _node != rhs._node;
+        }
+        
+        const value_type& value() const
+        {
+            return _node -> _value;
+        }
+        
+        const value_type& operator*() const
+        {
+            return value();
+        }
+        
+        const key_type& key() const
+        {
+            return _node -> _key;
+        }
+        
+        Iterator& operator++()
+        {
+            if (!_node)
+                return *this;
+            _node = _owner -> _next_leaf(&_node -> _key);
+            if (!_node)
+                _unpin_end();
+            return *this;
+        }
+        
+        const Iterator operator++(int)
+        {
+            Iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+        
+        Iterator& operator--()
+        {
+            if (!_node)
+                return *this;
+            _node = _owner -> _prev_leaf(_node -> _key);
+            if (!_node)
+                _unpin_end();
+            return *this;
+        }
+        
+        const Iterator operator--(int)
+        {
+            Iterator tmp = *this;
+            --(*this);
+            return tmp;
+        }
+    };
+    
+    lock_free_bst()
+    {
+        node* s = new node(key_type(), value_type(), inf1,
+                           new node(key_type(), value_type(), inf0),
+                           new node(key_type(), value_type(), inf1));
+        _root = new node(key_type(), value_type(), inf2, s, new node(key_type(), value_type(), inf2));
+    }
+    
+    lock_free_bst(const lock_free_bst&) = delete;
+    lock_free_bst& operator=(const lock_free_bst&) = delete;
+    
+    ~lock_free_bst()
+    {
+        std::vector<node*> stack;
+        stack.push_back(_root);
+        while (!stack.empty()) {
+            node* n = stack.back();
+            stack.pop_back();
+            if (!n -> leaf()) {
+                stack.push_back(_address(n -> _left.load()));
+                stack.push_back(_address(n -> _right.load()));
+            }
+            delete n;
+        }
+    }
+    
+    size_t size() const
+    {
+        return _size.sum();
+    }
+    
+    // cheap, may lag the exact size by a few dozen per thread
+    size_t approx_size() const
+    {
+        return _size.approx();
+    }
+    
+    bool empty() const
+    {
+        return _size.sum() == 0;
+    }
+    
+    Iterator begin() const
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        return Iterator(_next_leaf(nullptr), this);
+    }
+    
+    Iterator end() const
+    {
+        return Iterator();
+    }
+    
+    Iterator find(const key_type& key) const
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        seek_record s;
+        _seek(key, s);
+        return _equal(key, s.leaf) ? Iterator(s.leaf, this) : end();
+    }
+    
+    // the first element not less than key
+    Iterator lower_bound(const key_type& key) const
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        seek_record s;
+        _seek(key, s);
+        return Iterator(_equal(key, s.leaf) ? s.leaf : _next_leaf(&key), this);
+    }
+    
+    // the first element greater than key
+    Iterator upper_bound(const key_type& key) const
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        return Iterator(_next_leaf(&key), this);
+    }
+    
+    bool find(const key_type& key, value_type& value)
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        seek_record s;
+        _seek(key, s);
+        if (!_equal(key, s.leaf))
+            return false;
+        value = s.leaf -> _value;
+        return true;
+    }
+    
+    bool contains(const key_type& key)
+    {
+        value_type value;
+        return find(key, value);
+    }
+    
+    // inserts if the key is absent, an existing value is kept
+    bool insert(const key_type& key, const value_type& value)
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        node* fresh = new node(key, value, 0);
+        seek_record s;
+        while (true) {
+            _seek(key, s);
+            node* leaf = s.leaf;
+            if (_equal(key, leaf)) {
+                delete fresh;
+                return false;
+            }
+            
+            // the larger of the two keys routes between them
+            node* internal = _goes_left(key, leaf)
+                ? new node(leaf -> _key, value_type(), leaf -> _rank, fresh, leaf)
+                : new node(key, value_type(), 0, leaf, fresh);
+            
+            std::uintptr_t expected = _pointer(leaf);
+            if (_edge(s.parent, key).compare_exchange_strong(expected, _pointer(internal))) {
+                _size.increment();
+                return true;
+            }
+            delete internal;
+            
+            // the leaf or its parent is on the way out, help before trying again
+            if (_address(expected) == leaf && (expected & marks))
+                _cleanup(key, s);
+        }
+    }
+    
+    bool remove(const key_type& key)
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        seek_record s;
+        node* leaf = nullptr;
+        while (true) {
+            _seek(key, s);
+            if (!leaf) {
+                if (!_equal(key, s.leaf))
+                    return false;
+                
+                // flagging the edge is the point where the key is gone
+                std::uintptr_t expected = _pointer(s.leaf);
+                if (_edge(s.parent, key).compare_exchange_strong(expected, expected | flag)) {
+                    leaf = s.leaf;
+                    _size.decrement();
+                    if (_cleanup(key, s))
+                        return true;
+                } else if (_address(expected) == s.leaf && (expected & marks)) {
+                    _cleanup(key, s);
+                }
+            } else if (s.leaf != leaf || _cleanup(key, s)) {
+                // either this thread or a helper has unlinked the leaf
+                return true;
+            }
+        }
+    }
+    
+    /*
+     visits the elements in increasing key order; concurrent updates may
+     or may not be seen
+    */
+    template<typename Func>
+    void for_each(Func f)
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        std::vector<node*> stack;
+        node* n = _address(_root -> _left.load());
+        const node* last = nullptr;
+        while (n || !stack.empty()) {
+            while (n) {
+                stack.push_back(n);
+                n = _address(n -> _left.load());
+            }
+            n = stack.back();
+            stack.pop_back();
+            if (n -> leaf()) {
+                if (n -> _rank == 0 && (!last || last -> _key < n -> _key)) {
+                    f(n -> _key, n -> _value);
+                    last = n;
+                }
+                n = nullptr;
+            } else {
+                n = _address(n -> _right.load());
+            }
+        }
+    }
+
+private:
+    
+    static node* _address(std::uintptr_t field)
+    {
+        return reinterpret_cast<node*>(field & ~marks);
+    }
+    
+    static std::uintptr_t _pointer(node* n)
+    {
+        return reinterpret_cast<std::uintptr_t>(n);
+    }
+    
+    static bool _goes_left(const key_type& key, const node* n)
+    {
+        return n -> _rank > 0 || key < n -> _key;
+    }
+    
+    static bool _equal(const key_type& key, const node* n)
+    {
+        return n -> _rank == 0 && !(key < n -> _key) && !(n -> _key < key);
+    }
+    
+    static std::atomic<std::uintptr_t>& _edge(node* n, const key_type& key)
+    {
+        return _goes_left(key, n) ? n -> _left : n -> _right;
+    }
+    
+    /*
+     the leaf of the smallest key above *key, of the smallest key at all
+     for a null key; null if there is none. A right subtree passed on the
+     way down holds only larger keys, the last one passed is where to
+     continue when the leaf reached is not above key. A race may leave
+     only smaller keys there, then the search starts over.
+    */
+    node* _next_leaf(const key_type* key) const
+    {
+        while (true) {
+            node* candidate = nullptr;
+            node* n = _address(_root -> _left.load());
+            while (!n -> leaf()) {
+                if (!key || _goes_left(*key, n)) {
+                    candidate = _address(n -> _right.load());
+                    n = _address(n -> _left.load());
+                } else {
+                    n = _address(n -> _right.load());
+                }
+            }
+            if (n -> _rank == 0 && (!key || *key < n -> _key))
+                return n;
+            if (!candidate)
+                return nullptr;
+            
+            n = candidate;
+            while (!n -> leaf())
+                n = _address(n -> _left.load());
+            // the sentinels sort after every key
+            if (n -> _rank > 0)
+                return nullptr;
+            if (!key || *key < n -> _key)
+                return n;
+        }
+    }
+    
+    // the leaf of the largest key below key, the mirror of _next_leaf
+    node* _prev_leaf(const key_type& key) const
+    {
+        while (true) {
+            node* candidate = nullptr;
+            node* n = _address(_root -> _left.load());
+            while (!n -> leaf()) {
+                if (_goes_left(key, n)) {
+                    n = _address(n -> _left.load());
+                } else {
+                    candidate = _address(n -> _left.load());
+                    n = _address(n -> _right.load());
+                }
+            }
+            if (n -> _rank == 0 && n -> _key < key)
+                return n;
+            if (!candidate)
+                return nullptr;
+            
+            n = candidate;
+            while (!n -> leaf())
+                n = _address(n -> _right.load());
+            if (n -> _key < key)
+                return n;
+        }
+    }
+    
+    void _seek(const key_type& key, seek_record& s) const
+    {
+        s.ancestor = _root;
+        s.successor = _address(_root -> _left.load());
+        s.parent = s.successor;
+        
+        std::uintptr_t parent_field = s.parent -> _left.load();
+        s.leaf = _address(parent_field);
+        std::uintptr_t current_field = _edge(s.leaf, key).load();
+        node* current = _address(current_field);
+        while (current) {
+            if (!(parent_field & tag)) {
+                s.ancestor = s.parent;
+                s.successor = s.leaf;
+            }
+            s.parent = s.leaf;
+            s.leaf = current;
+            parent_field = current_field;
+            current_field = _edge(current, key).load();
+            current = _address(current_field);
+        }
+    }
+    
+    /*
+     Freezes the parent of the flagged leaf by tagging the edge to its
+     sibling and hangs the sibling from the ancestor in place of the
+     successor. Whoever wins that swap owns everything from the successor
+     down to the parent and retires it.
+    */
+    bool _cleanup(const key_type& key, const seek_record& s)
+    {
+        std::atomic<std::uintptr_t>& successor_edge = _edge(s.ancestor, key);
+        
+        bool left = _goes_left(key, s.parent);
+        std::atomic<std::uintptr_t>* child_edge = left ? &s.parent -> _left : &s.parent -> _right;
+        std::atomic<std::uintptr_t>* sibling_edge = left ? &s.parent -> _right : &s.parent -> _left;
+        // helping an insert that met a removal on the other side
+        if (!(child_edge -> load() & flag))
+            sibling_edge = child_edge;
+        
+        std::uintptr_t sibling = sibling_edge -> fetch_or(tag) & ~tag;
+        std::uintptr_t expected = _pointer(s.successor);
+        if (!successor_edge.compare_exchange_strong(expected, sibling))
+            return false;
+        
+        _retire_chain(s.successor, _address(sibling));
+        return true;
+    }
+    
+    // every node of the unlinked chain has one flagged leaf and goes on through the other edge
+    void _retire_chain(node* n, node* kept)
+    {
+        while (n != kept) {
+            node* l = _address(n -> _left.load());
+            node* r = _address(n -> _right.load());
+            node* next = (l == kept || (r != kept && r -> leaf())) ? l : r;
+            _reclaimer.retire(next == l ? r : l);
+            _reclaimer.retire(n);
+            n = next;
+        }
+    }
+};
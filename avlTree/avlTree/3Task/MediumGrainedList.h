@@ -4,6 +4,8 @@
 #include <cstddef>
 #include <shared_mutex>
 
+#include "sharded_counter.h"
+
 using std::shared_timed_mutex;
 using std::unique_lock;
 using std::shared_lock;
@@ -181,7 +183,7 @@ public:
         last -> _left = nullptr;
         last -> _right = nullptr;
         
-        _size = 0;
+        _size.reset();
         
         Node::receive(&first->_right, last);
         Node::receive(&last->_left, first);
@@ -196,7 +198,7 @@ public:
         last -> _left = nullptr;
         last -> _right = nullptr;
         
-        _size = 0;
+        _size.reset();
         
         Node::receive(&first->_right, last);
         Node::receive(&last->_left, first);
@@ -247,7 +249,7 @@ public:
             Node* newNode = new Node(value, this);
             unique_lock<shared_timed_mutex> lock(newNode -> mut);
             
-            _size++;
+            _size.increment();
             
             Node::receive(&previous -> _right, newNode);
             Node::receive(&newNode -> _left, previous);
@@ -304,7 +306,7 @@ public:
                 Node::receive(&previous -> _right, next);
                 Node::receive(&next -> _left, previous);
                 node -> deleted = true;
-                _size--;
+                _size.decrement();
                 
                 deleted = true;
                 
@@ -329,16 +331,21 @@ public:
     }
     
     bool empty() {
-        return !_size;
+        return _size.sum() == 0;
     }
     
     int size() {
-        return _size;
+        return _size.sum();
+    }
+    
+    // cheap, may lag the exact size by a few dozen per thread
+    size_t approx_size() {
+        return _size.approx();
     }
     
 private:
     Node* first;
     Node* last;
-    std::atomic<std::uint32_t> _size = {0};
+    sharded_counter _size;
     std::shared_timed_mutex list_mut;
 };
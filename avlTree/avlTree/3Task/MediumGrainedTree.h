@@ -1,15 +1,28 @@
 #pragma once
 #include <cstdint>
 #include <cstddef>
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <shared_mutex>
+#include <utility>
 #include "smart_pointer.h"
+#include "avl_height.h"
+#include "read_indicator.h"
+#include "sharded_counter.h"
+#include "RWSpinLock.h"
+#include "thread_pool.h"
 
 using smart_pointer::SmartPointer;
 using std::shared_timed_mutex;
 using std::unique_lock;
 using std::shared_lock;
 
-template<typename key_type, typename value_type>
+template<typename key_type, typename value_type, typename node_lock_type = RWSpinLock>
 class avl_tree
 {
     
@@ -19,19 +32,18 @@ class avl_tree
         
         key_type _key;
         value_type _value;
-        unsigned int _height;
         SmartPointer<node> _left;
         SmartPointer<node> _right;
-        SmartPointer<node> _parent;
-        bool deleted;
-        shared_timed_mutex mut;
+        std::uint8_t _height : avl_height_bits;
+        std::uint8_t deleted : 1;
+        node_lock_type mut;
         
         node(key_type key, value_type value)
         {
             _value = value;
             _key = key;
             _height = 1;
-            _left = _right = _parent = nullptr;
+            _left = _right = nullptr;
             deleted = false;
         }
         
@@ -40,22 +52,96 @@ class avl_tree
     
     using nodepntr = SmartPointer<node>;
     nodepntr _tree;
-    size_t _size = 0;
-
+    sharded_counter _size;
+    
+    /*
+     Relaxed balancing: writers only relink and record the key where they
+     changed the tree, a drain task on the shared thread_pool walks those
+     paths later and fixes heights and rotations. One drain runs at a
+     time and ends once the queue is empty. Every pending repair can add
+     one level, so a writer that finds max_pending queued helps drain the
+     queue before it goes on; this keeps the height well inside the 7
+     bits of the node.
+    */
+    static constexpr size_t max_pending = 64;
+    const bool _relaxed;
+    std::vector<key_type> _damaged;
+    size_t _in_repair = 0;
+    bool _draining = false;
+    std::mutex _damage_mutex;
+    std::condition_variable _idle_cv;
+    
+    /*
+     Snapshot scans: while one is open, writers stamp each change and keep
+     what the key held before it. A scan reads the live tree and puts back
+     the old state of every key changed after its own stamp. A change is
+     stamped once it is made, before its locks are let go: a stamp at or
+     below the scan's belongs to a change already in the tree, and a scan
+     that runs into a later change has passed one of its locks, so its
+     record is there when the scan closes.
+    */
+    struct change
+    {
+        std::uint64_t stamp;
+        key_type key;
+        bool existed;
+        value_type value;
+    };
+    
+    // writers that started before a scan opened are waited for instead of stamped
+    struct write_scope
+    {
+        avl_tree& owner;
+        bool counted;
+        bool logging;
+        
+        explicit write_scope(avl_tree& tree) : owner(tree)
+        {
+            counted = owner._unlogged_writers.arrive();
+            if (counted && owner._scans.load() != 0) {
+                owner._unlogged_writers.depart();
+                counted = false;
+            }
+            logging = !counted;
+        }
+        
+        ~write_scope()
+        {
+            if (counted)
+                owner._unlogged_writers.depart();
+        }
+    };
+    
+    // one log per thread slot, so logging writers do not queue on one mutex
+    struct alignas(64) history_shard
+    {
+        std::mutex mut;
+        std::vector<change> changes;
+    };
+    
+    std::atomic<int> _scans = {0};
+    read_indicator _unlogged_writers;
+    std::atomic<std::uint64_t> _clock = {0};
+    history_shard _history[thread_slot::max_threads];
+    // held while a stamp is taken and while the logs are trimmed
+    std::mutex _stamps_mutex;
+    std::vector<std::uint64_t> _open_stamps;
     
     class Iterator
     {
         friend avl_tree;
         nodepntr _node;
+        avl_tree* _owner;
         
     public:
-        explicit Iterator(nodepntr node = nullptr)
-        : _node(node)
+        explicit Iterator(nodepntr node = nullptr, avl_tree* owner = nullptr)
+        : _node(node), _owner(owner)
         {}
         
         Iterator& operator=(const Iterator& rhs){
             
             _node = rhs._node;
+            _owner = rhs._owner;
             return *this;
         }
         
@@ -85,29 +171,14 @@ class avl_tree
             return _node -> _key;
         }
         
+        // steps go by key from the root, so an iterator survives rotations
+        // and removal of the node it points to
         Iterator& operator++()
         {
             if(!_node){
                 return *this;
             }
-            
-            if (_node -> _right) {
-                auto tmp = _node -> _right;
-                _node = tmp;
-                while (_node -> _left) {
-                    _node = _node -> _left;
-                }
-            } else {
-                
-                nodepntr before;
-                
-                do {
-                    before = _node;
-                    _node = _node -> _parent;
-                } while (_node && before == _node -> _right);
-            }
-            if (_node && _node -> deleted)
-                operator++();
+            _node = _owner -> _successor(_node -> _key);
             return *this;
             
         }
@@ -125,22 +196,7 @@ class avl_tree
             if(!_node) {
                 return *this;
             }
-            
-            if (_node -> _left) {
-                auto tmp = _node -> _left;
-                _node = tmp;
-                
-                while (_node -> _right)
-                    _node = _node -> _right;
-            }
-            else {
-                nodepntr before;
-                do {
-                    before = _node;
-                    _node = _node -> _parent;
-                } while (_node && (_node -> deleted || before == _node -> _left));
-            }
-            
+            _node = _owner -> _predecessor(_node -> _key);
             return *this;
         }
         
@@ -155,9 +211,9 @@ class avl_tree
     
 public:
     
-    avl_tree() :
+    explicit avl_tree(bool relaxed = false) :
     _tree(new node(key_type(), value_type())),
-    _size(0)
+    _relaxed(relaxed)
     {}
     
     avl_tree(avl_tree& tree): avl_tree()
@@ -172,12 +228,13 @@ public:
     
     Iterator begin()
     {
-        return Iterator(findMin(_tree -> _left));
+        return Iterator(findMin(), this);
     }
     
     Iterator begin() const
     {
-        return Iterator(findMin(_tree -> _left));
+        auto self = const_cast<avl_tree*>(this);
+        return Iterator(self -> findMin(), self);
     }
     
     Iterator end()
@@ -192,46 +249,193 @@ public:
     
     size_t size()
     {
-
-        return _size;
+        
+        return _size.sum();
+    }
+    
+    // cheap, may lag the exact size by a few dozen per thread
+    size_t approx_size() const
+    {
+        return _size.approx();
     }
     
     bool empty() const
     {
-        return _size == static_cast<size_t>(0);
+        return _size.sum() == static_cast<size_t>(0);
+    }
+    
+    // memory taken by one element of the tree, without allocator overhead
+    static constexpr size_t node_size()
+    {
+        return sizeof(node);
     }
     
+    // not safe against concurrent writers
     void clear()
     {
-        _size = 0U;
-        _tree -> _left = NULL;
+        nodepntr root;
+        {
+            unique_lock<node_lock_type> lock (_tree -> mut);
+            root = _tree -> _left;
+            _tree -> _left = nullptr;
+            _size.reset();
+        }
+        _destroy(root);
     }
     
     Iterator insert(const key_type& key, const value_type& value)
     {
-        auto it = find(key);
-        if (it != end()) return it;
-        return _insert_iterative( key, value);
+        bool inserted;
+        return _insert_iterative(key, [&value] { return value; }, [](value_type&) { return false; }, inserted);
+    }
+    
+    /*
+     Applies fn(value&) to the value of key, first inserting value_type()
+     if the key is absent. One descent and fn runs under the node lock, so
+     two threads upserting the same key can neither both insert it nor
+     lose an update. True if the key was inserted.
+    */
+    template<typename Fn>
+    bool upsert(const key_type& key, Fn fn)
+    {
+        bool inserted;
+        _insert_iterative(key,
+                          [&fn] {
+                              value_type value = value_type();
+                              fn(value);
+                              return value;
+                          },
+                          [&fn](value_type& value) {
+                              fn(value);
+                              return true;
+                          },
+                          inserted);
+        return inserted;
+    }
+    
+    /*
+     Stores fn(current) for key, where current points to the value held
+     or is null for an absent key, and returns what was stored. Runs under
+     the node lock like upsert.
+    */
+    template<typename Fn>
+    value_type compute(const key_type& key, Fn fn)
+    {
+        value_type result;
+        bool inserted;
+        _insert_iterative(key,
+                          [&] {
+                              result = fn(static_cast<const value_type*>(nullptr));
+                              return result;
+                          },
+                          [&](value_type& value) {
+                              value = fn(static_cast<const value_type*>(&value));
+                              result = value;
+                              return true;
+                          },
+                          inserted);
+        return result;
+    }
+    
+    /*
+     Bulk load of (key, value) pairs on up to threads threads. The input is
+     sorted in parallel runs and merged; for an empty tree the halves of a
+     balanced tree are built in parallel and linked under the root lock in
+     one step. A tree that is not empty, or has a snapshot scan open, gets
+     no merge: each thread inserts one contiguous key range with ordinary
+     inserts, so the threads only meet near the root, but every key still
+     costs a descent and its own rebalance. The first of equal keys wins
+     and keys already in the tree keep their value.
+    */
+    template<typename InputIt>
+    void parallel_insert(InputIt first, InputIt last, unsigned threads = std::thread::hardware_concurrency())
+    {
+        std::vector<std::pair<key_type, value_type>> items(first, last);
+        if (items.empty())
+            return;
+        threads = static_cast<unsigned>(std::min<size_t>(std::max(threads, 1u), items.size()));
+        
+        _parallel_sort(items, threads);
+        items.erase(std::unique(items.begin(), items.end(),
+                                [](const std::pair<key_type, value_type>& a, const std::pair<key_type, value_type>& b) {
+                                    return !(a.first < b.first) && !(b.first < a.first);
+                                }),
+                    items.end());
+        
+        bool empty;
+        {
+            shared_lock<node_lock_type> lock (_tree -> mut);
+            empty = !_tree -> _left;
+        }
+        if (empty) {
+            nodepntr root = _build(items, 0, items.size(), threads);
+            bool linked = false;
+            {
+                // an open snapshot scan would need every key stamped, the plain inserts do that
+                write_scope scope (*this);
+                unique_lock<node_lock_type> lock (_tree -> mut);
+                if (!scope.logging && !_tree -> _left) {
+                    _tree -> _left = root;
+                    _size.add(static_cast<std::int64_t>(items.size()));
+                    linked = true;
+                }
+            }
+            if (linked)
+                return;
+            _destroy(root);
+        }
+        
+        size_t chunk = (items.size() + threads - 1) / threads;
+        thread_pool::shared().parallel_for(threads, [this, &items, chunk](size_t t) {
+            size_t hi = std::min(items.size(), (t + 1) * chunk);
+            for (size_t i = t * chunk; i < hi; i++)
+                insert(items[i].first, items[i].second);
+        });
     }
     
     bool remove(const key_type& key)
     {
-        auto nd = _find(_tree -> _left, key);
-        if (!nd) return false;
-        remove(Iterator(nd));
-        return true;
+        return _erase([&key](const nodepntr& n) { return _direction(key, n); },
+                      [](const nodepntr&) { return true; });
     }
     
     bool remove(Iterator pos) {
-        return _remove_iterative(pos);
+        if (!pos._node)
+            return false;
+        
+        nodepntr target = pos._node;
+        const key_type& key = target -> _key;
+        return _erase([&key](const nodepntr& n) { return _direction(key, n); },
+                      [&target](const nodepntr& n) { return n == target; });
+    }
+    
+    /*
+     Removes the smallest element and hands it out, false for an empty tree.
+     Every element goes to exactly one caller. Pops from one end all lock
+     their way down the same spine to the same node, so they take turns
+     there. A strict tree also keeps the spine above an unbalanced node
+     locked for the rebalance, often up to the root, and concurrent pops
+     then run one after another. A relaxed tree lets go of each node once
+     its child is locked, so pops follow each other down the spine and
+     only meet at the extreme node.
+    */
+    bool pop_min(key_type& key, value_type& value) {
+        return _pop_extreme(true, [](const key_type&, const value_type&) { return true; }, key, value);
+    }
+    
+    bool pop_max(key_type& key, value_type& value) {
+        return _pop_extreme(false, [](const key_type&, const value_type&) { return true; }, key, value);
+    }
+    
+    // pops the smallest element only if pred(key, value) holds for it
+    template<typename Pred>
+    bool try_pop_min_if(Pred pred, key_type& key, value_type& value) {
+        return _pop_extreme(true, pred, key, value);
     }
     
     Iterator find(const key_type& key)
     {
-        if (!_tree -> _left){
-            return end();
-        }
-        return Iterator(_find(_tree -> _left, key));
+        return Iterator(_find(key), this);
     }
     
     value_type& operator[](const key_type& key)
@@ -246,13 +450,176 @@ public:
         return res.value();
     }
     
+    // relaxed mode: returns once every recorded change has been rebalanced
+    void wait_rebalanced()
+    {
+        std::unique_lock<std::mutex> lock (_damage_mutex);
+        _idle_cv.wait(lock, [this] { return !_draining; });
+    }
+    
+    /*
+     true if every stored height is exact and no node tilts by more than
+     one; takes no locks, for a tree no thread is changing
+    */
+    bool balanced()
+    {
+        return _checked_height(_tree -> _left.peek()) >= 0;
+    }
+    
+    /*
+     Visits from <= key < to in order, as the range was at one moment,
+     without blocking writers. The range is copied out before f is called.
+     Values changed in place through an iterator are not versioned.
+    */
+    template<typename Func>
+    void snapshot_scan(const key_type& from, const key_type& to, Func f)
+    {
+        for (const auto& item : _snapshot(&from, &to))
+            f(item.first, item.second);
+    }
+    
+    /*
+     Parallel algorithms over a snapshot: the whole tree as it was at one
+     moment is copied out like in snapshot_scan, then split among up to
+     threads threads, so writers never wait for f or map. Both run on
+     several threads at once. The copy itself is serial and looks every
+     successor up from the root, O(n log n), so only the calls of f and
+     map get faster; these exist so the trees share one interface, and
+     pay off only when f or map costs more than a lookup.
+    */
+    template<typename Func>
+    void parallel_for_each(Func f, unsigned threads = std::thread::hardware_concurrency())
+    {
+        std::vector<std::pair<key_type, value_type>> items = _snapshot(nullptr, nullptr);
+        if (items.empty())
+            return;
+        size_t count = std::min<size_t>(std::max(threads, 1u), items.size());
+        thread_pool::shared().parallel_for(count, [&](size_t t) {
+            for (size_t i = t * items.size() / count; i < (t + 1) * items.size() / count; i++)
+                f(static_cast<const key_type&>(items[i].first), static_cast<const value_type&>(items[i].second));
+        });
+    }
+    
+    // map(key, value) of every element, joined in key order by an associative combine
+    template<typename T, typename Map, typename Combine>
+    T parallel_reduce(T init, Map map, Combine combine, unsigned threads = std::thread::hardware_concurrency())
+    {
+        std::vector<std::pair<key_type, value_type>> items = _snapshot(nullptr, nullptr);
+        if (items.empty())
+            return init;
+        size_t count = std::min<size_t>(std::max(threads, 1u), items.size());
+        std::vector<T> partial(count, init);
+        thread_pool::shared().parallel_for(count, [&](size_t t) {
+            size_t lo = t * items.size() / count, hi = (t + 1) * items.size() / count;
+            // every run holds at least one element
+            partial[t] = map(static_cast<const key_type&>(items[lo].first), static_cast<const value_type&>(items[lo].second));
+            for (size_t i = lo + 1; i < hi; i++)
+                partial[t] = combine(partial[t], map(static_cast<const key_type&>(items[i].first),
+                                                     static_cast<const value_type&>(items[i].second)));
+        });
+        
+        T res = init;
+        for (const T& part : partial)
+            res = combine(res, part);
+        return res;
+    }
+    
     ~avl_tree()
     {
+        if (_relaxed)
+            wait_rebalanced();
         clear();
     }
-    
+
 private:
     
+    /*
+     Exclusive locks taken top-down during one descent, index 0 is the
+     topmost node still held. Writers drop the prefix above a node that
+     absorbs the change, so only nodes whose links or heights may change
+     stay locked.
+    */
+    struct locked_path
+    {
+        std::vector<nodepntr> nodes;
+        std::vector<unique_lock<node_lock_type>> locks;
+        
+        void push(nodepntr n)
+        {
+            locks.emplace_back(n -> mut);
+            nodes.push_back(std::move(n));
+        }
+        
+        void pop()
+        {
+            locks.pop_back();
+            nodes.pop_back();
+        }
+        
+        void clear()
+        {
+            locks.clear();
+            nodes.clear();
+        }
+        
+        void release(size_t from, size_t to)
+        {
+            locks.erase(locks.begin() + from, locks.begin() + to);
+            nodes.erase(nodes.begin() + from, nodes.begin() + to);
+        }
+        
+        // by mutex: after a rotation nodes[i] is the new subtree root while locks[i] still guards the old one
+        bool holds(const nodepntr& n) const
+        {
+            for (const auto& held : locks) {
+                if (held.mutex() == &n -> mut)
+                    return true;
+            }
+            return false;
+        }
+        
+        size_t size() const
+        {
+            return nodes.size();
+        }
+    };
+    
+    static int _direction(const key_type& key, const nodepntr& n)
+    {
+        if (key < n -> _key)
+            return -1;
+        if (n -> _key < key)
+            return 1;
+        return 0;
+    }
+    
+    /*
+     releases the subtree node by node, without recursive destructors
+    */
+    void _destroy(nodepntr root)
+    {
+        std::vector<nodepntr> stack;
+        
+        if (root){
+            stack.push_back(std::move(root));
+        }
+        
+        while (!stack.empty()){
+            nodepntr nd = std::move(stack.back());
+            stack.pop_back();
+            
+            if (nd -> _left){
+                stack.push_back(nd -> _left);
+            }
+            if (nd -> _right){
+                stack.push_back(nd -> _right);
+            }
+            // nd goes at the end of this pass and takes no children along
+            nd -> _left = nullptr;
+            nd -> _right = nullptr;
+        }
+    }
+    
     unsigned int height(nodepntr _node)
     {
         return _node ? _node -> _height : 0;
@@ -262,313 +629,663 @@ private:
         return height(_node -> _right) - height(_node -> _left);
     }
     
+    /*
+     the height shares a byte with the deleted flag and is read by whoever
+     holds the parent, so it is only stored when it really changes
+    */
     void updHeight (nodepntr _node)
     {
         if (_node){
             unsigned int hl = height(_node -> _left);
             unsigned int hr = height(_node -> _right);
-            _node -> _height = (hr > hl ? hr : hl) + 1;
+            unsigned int h = (hr > hl ? hr : hl) + 1;
+            if (_node -> _height != h)
+                _node -> _height = h;
         }
     }
     
+    // the caller links the returned node to the old parent
     nodepntr rightRotate(nodepntr _node)
     {
         nodepntr tmp = _node -> _left;
-        _node -> _left = tmp -> _right;
-        tmp -> _right = _node;
-        updHeight(_node);
-        updHeight(tmp);
+        set_left(_node, tmp -> _right);
+        set_right(tmp, _node);
         return tmp;
     }
     
     nodepntr leftRotate(nodepntr _node)
     {
         nodepntr tmp = _node -> _right;
-        _node -> _right = tmp -> _left;
-        tmp -> _left = _node;
-        updHeight(_node);
-        updHeight(tmp);
+        set_right(_node, tmp -> _left);
+        set_left(tmp, _node);
         return tmp;
     }
     
-    nodepntr balance(nodepntr _node)
+    /*
+     n is held and off balance by two; the child on the heavy side and,
+     for a double rotation, its inner child are locked here unless the
+     descent already holds them
+    */
+    nodepntr _rotate(locked_path& path, nodepntr n)
     {
-        updHeight(_node);
+        bool right_heavy = bfactor(n) > 0;
+        nodepntr child = right_heavy ? n -> _right : n -> _left;
+        unique_lock<node_lock_type> child_lock;
+        if (!path.holds(child))
+            child_lock = unique_lock<node_lock_type>(child -> mut);
         
-        if (bfactor(_node) == 2){
-            if (bfactor(_node -> _right) < 0){
-                _node -> _right = rightRotate(_node -> _right);
+        unique_lock<node_lock_type> inner_lock;
+        if (right_heavy ? bfactor(child) < 0 : bfactor(child) > 0) {
+            nodepntr inner = right_heavy ? child -> _left : child -> _right;
+            if (!path.holds(inner))
+                inner_lock = unique_lock<node_lock_type>(inner -> mut);
+            
+            if (right_heavy)
+                set_right(n, rightRotate(child));
+            else
+                set_left(n, leftRotate(child));
+        }
+        return right_heavy ? leftRotate(n) : rightRotate(n);
+    }
+    
+    // walks a locked path bottom-up, fixing heights and rotating where needed
+    void _rebalance(locked_path& path)
+    {
+        for (size_t i = path.size(); i-- > 0; ) {
+            nodepntr n = path.nodes[i];
+            if (n == _tree)
+                break;
+            
+            updHeight(n);
+            int bf = bfactor(n);
+            if (bf >= 2 || bf <= -2) {
+                nodepntr res = _rotate(path, n);
+                _replace_child(path.nodes[i - 1], n, res);
+                path.nodes[i] = res;
+            }
+        }
+    }
+    
+    // the height of the subtree, -1 if it breaks the AVL invariants
+    static int _checked_height(node* n)
+    {
+        if (!n)
+            return 0;
+        int hl = _checked_height(n -> _left.peek());
+        int hr = _checked_height(n -> _right.peek());
+        if (hl < 0 || hr < 0 || std::abs(hl - hr) > 1 || int(n -> _height) != std::max(hl, hr) + 1)
+            return -1;
+        return std::max(hl, hr) + 1;
+    }
+    
+    // hands key to the drain task, false once max_pending are waiting
+    bool _queue_repair(const key_type& key)
+    {
+        bool start;
+        {
+            std::lock_guard<std::mutex> lock (_damage_mutex);
+            if (_damaged.size() + _in_repair >= max_pending)
+                return false;
+            _damaged.push_back(key);
+            start = !_draining;
+            _draining = true;
+        }
+        if (start)
+            thread_pool::shared().submit([this] { _drain_damage(); });
+        return true;
+    }
+    
+    // for writers, who hold no locks here; with the queue full they run pool tasks, the drain among them
+    void _defer_repair(const key_type& key)
+    {
+        while (!_queue_repair(key)) {
+            if (!thread_pool::shared().run_one())
+                std::this_thread::yield();
+        }
+    }
+    
+    /*
+     Rebalances upwards from the node holding key, whose subtree changed.
+     Each step locks just that node and its parent, fixes the node's
+     height and rotates it if it tilts by two or more. Only when the
+     subtree ends up with another height does the parent get a step of
+     its own, so the locks reach towards the root only as far as heights
+     really change. A rotation in a relaxed subtree may leave the nodes it
+     moved tilted; they get steps too, deepest first.
+    */
+    void _repair(const key_type& key)
+    {
+        std::vector<key_type> todo(1, key);
+        while (!todo.empty()) {
+            key_type next = todo.back();
+            todo.pop_back();
+            
+            locked_path path;
+            // gone from the tree; its remover repairs that spot
+            if (!_lock_with_parent(next, path))
+                continue;
+            
+            nodepntr parent = path.nodes[0];
+            nodepntr n = path.nodes[1];
+            unsigned int before = n -> _height;
+            updHeight(n);
+            nodepntr res = n;
+            if (std::abs(bfactor(n)) > 1) {
+                res = _rotate(path, n);
+                _replace_child(parent, n, res);
+            }
+            
+            if (res -> _height != before && parent != _tree)
+                todo.push_back(parent -> _key);
+            if (res != n) {
+                if (std::abs(bfactor(res)) > 1)
+                    todo.push_back(res -> _key);
+                for (nodepntr c : {res -> _left, res -> _right}) {
+                    if (c && std::abs(bfactor(c)) > 1)
+                        todo.push_back(c -> _key);
+                }
             }
-            return leftRotate(_node);
         }
-        else if (bfactor(_node) == -2){
-            if (bfactor(_node -> _left) > 0){
-                _node -> _left = leftRotate(_node -> _left);
+    }
+    
+    /*
+     Locks the parent of the node holding key and then the node, both
+     exclusively, false if the key is not in the tree. The parent comes
+     from a shared descent and is checked once held: only the holder of a
+     node relinks its children, so a confirmed link stays put.
+    */
+    bool _lock_with_parent(const key_type& key, locked_path& path)
+    {
+        while (true) {
+            nodepntr parent = _tree;
+            bool found = false;
+            _walk([&](const nodepntr& n) {
+                int dir = _direction(key, n);
+                if (dir == 0) {
+                    found = true;
+                    return nodepntr(nullptr);
+                }
+                parent = n;
+                return dir < 0 ? n -> _left : n -> _right;
+            });
+            if (!found)
+                return false;
+            
+            path.push(parent);
+            nodepntr n = parent == _tree ? _tree -> _left
+                : _direction(key, parent) < 0 ? parent -> _left : parent -> _right;
+            if ((parent == _tree || !parent -> deleted) && n && _direction(key, n) == 0) {
+                path.push(n);
+                return true;
             }
-            return rightRotate(_node);
+            path.clear();
         }
-        else {
-            return _node;
+    }
+    
+    void _drain_damage()
+    {
+        auto less = [](const key_type& a, const key_type& b) { return a < b; };
+        auto same = [](const key_type& a, const key_type& b) { return !(a < b) && !(b < a); };
+        
+        std::unique_lock<std::mutex> lock (_damage_mutex);
+        while (!_damaged.empty()) {
+            std::vector<key_type> batch;
+            batch.swap(_damaged);
+            _in_repair = batch.size();
+            lock.unlock();
+            
+            // one pass per distinct key, in key order so neighbouring paths stay cached
+            std::sort(batch.begin(), batch.end(), less);
+            batch.erase(std::unique(batch.begin(), batch.end(), same), batch.end());
+            for (const auto& key : batch)
+                _repair(key);
+            
+            lock.lock();
+            _in_repair = 0;
         }
+        // the tree may be destroyed once the lock is released
+        _draining = false;
+        _idle_cv.notify_all();
     }
     
-    nodepntr _insert(nodepntr _node, key_type key, value_type val)
+    std::uint64_t _open_snapshot()
     {
-        if( !_node ){
-            return nodepntr(new node(key, val));
+        _scans++;
+        // a writer that missed the count must be done before the stamp is taken
+        while (!_unlogged_writers.empty())
+            std::this_thread::yield();
+        
+        std::lock_guard<std::mutex> lock (_stamps_mutex);
+        std::uint64_t stamp = _clock.load();
+        _open_stamps.push_back(stamp);
+        return stamp;
+    }
+    
+    // copy of from <= key < to as it was at one moment; a null bound is open
+    std::vector<std::pair<key_type, value_type>> _snapshot(const key_type* from, const key_type* to)
+    {
+        std::uint64_t stamp = _open_snapshot();
+        
+        std::vector<std::pair<key_type, value_type>> live;
+        nodepntr n = from ? _ceiling(*from) : findMin();
+        while (n && (!to || n -> _key < *to)) {
+            {
+                shared_lock<node_lock_type> lock (n -> mut);
+                live.emplace_back(n -> _key, n -> _value);
+            }
+            n = _successor(n -> _key);
         }
         
-        else if( key < _node -> _key ) {
-            _node -> _left = _insert( _node -> _left, key, val);
+        std::vector<change> later = _close_snapshot(stamp, from, to);
+        
+        std::vector<std::pair<key_type, value_type>> res;
+        size_t i = 0, j = 0;
+        while (i < live.size() || j < later.size()) {
+            if (j == later.size() || (i < live.size() && live[i].first < later[j].key)) {
+                res.push_back(std::move(live[i]));
+                i++;
+                continue;
+            }
+            if (i < live.size() && !(later[j].key < live[i].first))
+                i++;
+            if (later[j].existed)
+                res.emplace_back(later[j].key, later[j].value);
+            j++;
         }
+        return res;
+    }
+    
+    // the oldest state of every key in the range changed after stamp, by key
+    std::vector<change> _close_snapshot(std::uint64_t stamp, const key_type* from, const key_type* to)
+    {
+        std::vector<change> later;
+        {
+            std::lock_guard<std::mutex> lock (_stamps_mutex);
+            _open_stamps.erase(std::find(_open_stamps.begin(), _open_stamps.end(), stamp));
+            // a scan opened later takes a stamp at least the clock's now
+            std::uint64_t oldest = _open_stamps.empty() ? _clock.load()
+                : *std::min_element(_open_stamps.begin(), _open_stamps.end());
+            
+            for (auto& shard : _history) {
+                std::lock_guard<std::mutex> shard_lock (shard.mut);
+                for (const auto& c : shard.changes) {
+                    if (c.stamp > stamp && (!from || !(c.key < *from)) && (!to || c.key < *to))
+                        later.push_back(c);
+                }
+                shard.changes.erase(std::remove_if(shard.changes.begin(), shard.changes.end(),
+                                                   [oldest](const change& c) { return c.stamp <= oldest; }),
+                                    shard.changes.end());
+            }
+        }
+        _scans--;
         
-        else if (key > _node -> _key ){
-            _node -> _right = _insert( _node -> _right, key, val);
+        // by key, the oldest change first
+        std::sort(later.begin(), later.end(), [](const change& a, const change& b) {
+            return a.key < b.key || (!(b.key < a.key) && a.stamp < b.stamp);
+        });
+        later.erase(std::unique(later.begin(), later.end(),
+                                [](const change& a, const change& b) { return !(a.key < b.key) && !(b.key < a.key); }),
+                    later.end());
+        return later;
+    }
+    
+    // the caller has made the change and still holds the locks that publish it
+    void _record(const key_type& key, bool existed, const value_type& value)
+    {
+        int idx = thread_slot::index();
+        history_shard& shard = _history[idx < 0 ? 0 : idx];
+        std::lock_guard<std::mutex> lock (shard.mut);
+        shard.changes.push_back({++_clock, key, existed, value});
+    }
+    
+    // stable sort by key: sorted runs, then rounds of pairwise merges
+    static void _parallel_sort(std::vector<std::pair<key_type, value_type>>& items, unsigned threads)
+    {
+        auto less = [](const std::pair<key_type, value_type>& a, const std::pair<key_type, value_type>& b) {
+            return a.first < b.first;
+        };
+        size_t chunk = (items.size() + threads - 1) / threads;
+        std::vector<size_t> bounds;
+        for (size_t b = 0; b < items.size(); b += chunk)
+            bounds.push_back(b);
+        bounds.push_back(items.size());
+        
+        auto begin = items.begin();
+        thread_pool::shared().parallel_for(bounds.size() - 1, [&](size_t i) {
+            std::stable_sort(begin + bounds[i], begin + bounds[i + 1], less);
+        });
+        
+        while (bounds.size() > 2) {
+            std::vector<size_t> next;
+            for (size_t i = 0; i + 2 < bounds.size(); i += 2)
+                next.push_back(bounds[i]);
+            // an odd run waits for the next round
+            if (bounds.size() % 2 == 0)
+                next.push_back(bounds[bounds.size() - 2]);
+            next.push_back(bounds.back());
+            
+            thread_pool::shared().parallel_for((bounds.size() - 1) / 2, [&](size_t i) {
+                std::inplace_merge(begin + bounds[2 * i], begin + bounds[2 * i + 1], begin + bounds[2 * i + 2], less);
+            });
+            bounds.swap(next);
         }
+    }
+    
+    // balanced subtree over items[lo, hi); the left half is forked to the pool while spare allows
+    nodepntr _build(const std::vector<std::pair<key_type, value_type>>& items, size_t lo, size_t hi, unsigned spare)
+    {
+        if (lo >= hi)
+            return nodepntr(nullptr);
         
-        return balance(_node);
+        size_t mid = lo + (hi - lo) / 2;
+        nodepntr n (new node(items[mid].first, items[mid].second));
+        nodepntr left;
+        if (spare > 1) {
+            thread_pool::task_group group;
+            group.fork([&] { left = _build(items, lo, mid, spare / 2); });
+            n -> _right = _build(items, mid + 1, hi, spare - spare / 2);
+            group.join();
+        } else {
+            left = _build(items, lo, mid, 1);
+            n -> _right = _build(items, mid + 1, hi, 1);
+        }
+        n -> _left = left;
+        updHeight(n);
+        return n;
     }
     
     void set_left(nodepntr src, nodepntr n) {
         src -> _left = n;
-        set_parent(src, n);
         updHeight(src);
     }
     
     void set_right(nodepntr src, nodepntr n) {
         src -> _right = n;
-        set_parent(src, n);
         updHeight(src);
     }
     
-    void set_parent(nodepntr src, nodepntr n) {
-        if (n)
-            n -> _parent = src;
-    }
-    
-    Iterator _insert_iterative(const key_type& key, const value_type& value)
+    /*
+     Descends with exclusive lock coupling. A node whose lower side is the
+     insertion side absorbs the growth, so everything above it is released;
+     a node leaning towards the insertion side may rotate, so only its
+     parent is kept above it.
+    */
+    /*
+     make() gives the value of a new node; update(value) runs on an
+     existing one while it is held and returns whether it changed it.
+    */
+    template<typename Make, typename Update>
+    Iterator _insert_iterative(const key_type& key, Make make, Update update, bool& inserted)
     {
-        nodepntr nd (new node(key, value));
-        _insert_node(nd);
-        _balance_iterative(nd);
-        _size++;
-        set_parent(nodepntr(nullptr), _tree -> _left);
-        return Iterator(_find(_tree -> _left, key));
-    }
-    
-    void _insert_node(nodepntr nd) {
-        unique_lock<shared_timed_mutex> node_lock (nd -> mut);
-        auto parent = _tree -> _left;
+        write_scope scope (*this);
+        locked_path path;
+        path.push(_tree);
+        nodepntr n = _tree -> _left;
+        nodepntr nd;
         
-        if (!parent) {
-            unique_lock<shared_timed_mutex> ins_lock (_tree -> mut);
+        inserted = true;
+        if (!n) {
+            nd = nodepntr(new node(key, make()));
             _tree -> _left = nd;
-            return;
+            if (scope.logging)
+                _record(key, false, value_type());
+            _size.increment();
+            return Iterator(nd, this);
         }
         
-        while (parent) {
-            unique_lock<shared_timed_mutex> ins_lock (parent -> mut);
-            if (nd -> _key < parent -> _key) {
-                if (!parent -> _left) {
-                    set_left(parent, nd);
-                    break;
-                } else {
-                    unique_lock<shared_timed_mutex> lock_tmp(parent -> _left -> mut);
-                    parent = parent -> _left;
-                }
-            } else if (nd -> _key > parent -> _key) {
-                if (!parent -> _right) {
-                    set_right(parent, nd);
-                    break;
+        path.push(n);
+        while (true) {
+            int dir = _direction(key, n);
+            if (dir == 0) {
+                inserted = false;
+                if (scope.logging) {
+                    value_type old = n -> _value;
+                    if (update(n -> _value))
+                        _record(key, true, old);
                 } else {
-                    unique_lock<shared_timed_mutex> lock_tmp( parent -> _right -> mut);
-                    parent = parent -> _right;
+                    update(n -> _value);
                 }
+                return Iterator(n, this);
             }
-        }
-    }
-    
-    void _balance_iterative(nodepntr nd) {
-        nodepntr n = nd;
-        
-        while (n) {
-            auto res = n;
-            auto parent = n -> _parent;
             
-            if (bfactor(n) == 2) {
-                if (bfactor(n -> _right) < 0)
-                    set_right(n, rightRotate(n -> _right));
-                
-                res = leftRotate(n);
-            }
-            if (bfactor(n) == -2) {
-                if (bfactor(n -> _left) > 0)
-                    set_left(n, leftRotate(n -> _left));
-                
-                res = rightRotate(n);
-            }
-            if (!parent) {
-                _tree -> _left = res;
+            size_t i = path.size() - 1;
+            if (_relaxed) {
+                // only the node that gets the new child has to be held
+                path.release(0, i);
             } else {
-                if (parent -> _left == n)
-                    set_left(parent, res);
-                else
-                    set_right(parent, res);
+                unsigned int same = height(dir < 0 ? n -> _left : n -> _right);
+                unsigned int other = height(dir < 0 ? n -> _right : n -> _left);
+                if (same < other) {
+                    path.release(0, i);
+                } else if (same > other) {
+                    path.release(0, i - 1);
+                }
             }
             
-            n = parent;
+            nodepntr next = dir < 0 ? n -> _left : n -> _right;
+            if (!next) {
+                nd = nodepntr(new node(key, make()));
+                path.push(nd);
+                if (dir < 0)
+                    n -> _left = nd;
+                else
+                    n -> _right = nd;
+                if (scope.logging)
+                    _record(key, false, value_type());
+                break;
+            }
+            path.push(next);
+            n = next;
+        }
+        
+        _size.increment();
+        if (_relaxed) {
+            // n got the new child, its subtree is where heights changed
+            key_type changed = n -> _key;
+            path.clear();
+            _defer_repair(changed);
+        } else {
+            _rebalance(path);
         }
+        return Iterator(nd, this);
     }
     
-    bool _remove_iterative(Iterator pos) {
-        if (!pos._node || pos._node -> deleted)
-            return false;
-        
-        auto res = _remove_node(pos._node);
-        _balance_iterative(res);
-        
-        set_parent(nodepntr(nullptr), _tree -> _left);
-        _size--;
-        return true;
+    // links only, the heights are left to the rebalance walk
+    void _replace_child(nodepntr parent, nodepntr old, nodepntr nd) {
+        if (parent == _tree) {
+            _tree -> _left = nd;
+        } else if (parent -> _left == old) {
+            parent -> _left = nd;
+        } else {
+            parent -> _right = nd;
+        }
     }
     
-    nodepntr _remove_node(nodepntr n) {
-        auto to_delete = n;
-        auto to_rebalance = nodepntr(nullptr);
-        auto to_replace = n;
-        auto to_replace_parent = nodepntr(nullptr);
+    /*
+     Removal descent. dir(n) picks the side to go on (0 stops at n) and
+     accept(n) confirms the node found. A balanced node only tilts when
+     one of its sides shrinks, so everything above it is released. A node
+     with two children is replaced by its successor; the target and its
+     parent stay locked while the path to the successor is coupled below.
+    */
+    template<typename Dir, typename Accept>
+    bool _erase(Dir dir, Accept accept)
+    {
+        write_scope scope (*this);
+        // keeps the unlinked target alive until its lock is let go
+        nodepntr target;
+        unique_lock<node_lock_type> target_lock;
+        locked_path path;
+        path.push(_tree);
+        nodepntr n = _tree -> _left;
+        if (!n)
+            return false;
         
-        if (!to_delete -> _left && !to_delete -> _right && !to_delete -> _parent) {
-            _tree -> _left = nodepntr(nullptr);
-            to_delete -> deleted = true;
-            return to_rebalance;
-        }
-        if (to_replace -> _right) {
-            to_replace = to_replace -> _right;
-            while (to_replace -> _left)
-                to_replace = to_replace -> _left;
-            
-            to_replace_parent = to_replace -> _parent;
-            
-            
-            set_parent(to_delete -> _parent, to_replace);
-            set_left(to_replace, to_delete -> _left);
-            if(to_delete -> _right != to_replace)
-                set_right(to_replace, to_delete -> _right);
-            
+        path.push(n);
+        int d;
+        while ((d = dir(n)) != 0) {
+            nodepntr next = d < 0 ? n -> _left : n -> _right;
+            if (!next)
+                return false;
             
+            if (_relaxed || height(n -> _left) == height(n -> _right))
+                path.release(0, path.size() - 1);
+            path.push(next);
+            n = next;
         }
-        else {
-            if(to_replace -> _left)
-                to_replace = to_replace -> _left;
-            else
-                to_replace = nodepntr(nullptr);
-        }
-        
-        
-        
-        if(to_replace && to_replace -> _parent != to_delete)
-            to_rebalance = to_replace -> _parent;
         
-        auto to_delete_parent = n -> _parent;
+        if (!accept(n))
+            return false;
         
-        if (to_delete_parent) {
-            if (to_delete_parent -> _left == to_delete)
-                set_left(to_delete_parent, to_replace);
-            else
-                set_right(to_delete_parent, to_replace);
+        target = n;
+        size_t t = path.size() - 1;
+        if (n -> _left && n -> _right) {
+            nodepntr s = n -> _right;
+            path.push(s);
+            while (s -> _left) {
+                if (_relaxed || height(s -> _left) == height(s -> _right))
+                    path.release(t + 1, path.size() - 1);
+                s = s -> _left;
+                path.push(s);
+            }
+            
+            nodepntr s_parent = path.nodes[path.size() - 2];
+            unique_lock<node_lock_type> successor_lock = std::move(path.locks.back());
+            path.pop();
             
-            if (!to_delete -> _left && !to_delete -> _right)
-                to_rebalance = to_delete_parent;
+            if (s_parent != n) {
+                s_parent -> _left = s -> _right;
+                s -> _right = n -> _right;
+            }
+            s -> _left = n -> _left;
+            // what the parent last saw below it; a repair compares against this
+            s -> _height = n -> _height;
+            _replace_child(path.nodes[t - 1], n, s);
+            // s takes the target's place on the path, lock included
+            target_lock = std::move(path.locks[t]);
+            path.locks[t] = std::move(successor_lock);
+            path.nodes[t] = s;
+            n -> deleted = true;
+        } else {
+            _replace_child(path.nodes[t - 1], n, n -> _left ? n -> _left : n -> _right);
+            n -> deleted = true;
+            target_lock = std::move(path.locks.back());
+            path.pop();
         }
+        if (scope.logging)
+            _record(n -> _key, true, n -> _value);
+        _size.decrement();
         
-        to_delete->deleted = true;
-        if(to_replace && !to_replace -> _parent && !to_replace -> _left && !to_replace -> _right)
-            _tree -> _left = to_replace;
-        if(to_replace_parent && to_replace_parent != n) {
-            if(to_replace_parent -> _left == to_replace)
-                set_left(to_replace_parent, nodepntr(nullptr));
-            else
-                set_right(to_replace_parent, nodepntr(nullptr));
+        if (!_relaxed) {
+            _rebalance(path);
+        } else if (path.nodes.back() != _tree) {
+            // the deepest node whose subtree changed; its repair climbs past the successor
+            key_type key = path.nodes.back() -> _key;
+            path.clear();
+            _defer_repair(key);
         }
-        return to_rebalance;
+        return true;
     }
-    nodepntr findMin(nodepntr _node)
+    
+    template<typename Pred>
+    bool _pop_extreme(bool leftmost, Pred pred, key_type& key, value_type& value) {
+        auto dir = [leftmost](const nodepntr& n) {
+            if (leftmost)
+                return n -> _left ? -1 : 0;
+            return n -> _right ? 1 : 0;
+        };
+        auto accept = [&](const nodepntr& n) {
+            if (!pred(n -> _key, n -> _value))
+                return false;
+            key = n -> _key;
+            value = n -> _value;
+            return true;
+        };
+        return _erase(dir, accept);
+    }
+    
+    /*
+     Shared lock coupling from the root: the child is locked before its
+     parent is let go. step(n) returns the child to continue with, or null
+     to stop; the last node visited is returned.
+    */
+    template<typename Step>
+    nodepntr _walk(Step step)
     {
-        return _node -> _left ? findMin(_node -> _left) : _node;
+        shared_lock<node_lock_type> lock (_tree -> mut);
+        nodepntr n = _tree -> _left;
+        nodepntr last;
+        while (n) {
+            shared_lock<node_lock_type> next_lock (n -> mut);
+            lock.swap(next_lock);
+            next_lock.unlock();
+            last = n;
+            n = step(n);
+        }
+        return last;
     }
     
-    nodepntr findMin(nodepntr _node) const
+    nodepntr findMin()
     {
-        return _node -> _left ? findMin(_node -> _left) : _node;
+        return _walk([](const nodepntr& n) { return n -> _left; });
     }
     
-    nodepntr findMax(nodepntr _node)
+    nodepntr findMax()
     {
-        return _node -> _right ? findMax(_node -> _right) : _node;
+        return _walk([](const nodepntr& n) { return n -> _right; });
     }
     
-    nodepntr _find(nodepntr _node, const key_type& key)
+    nodepntr _find(const key_type& key)
     {
-        if(_node -> _left && _node -> _key > key){
-            return _find(_node -> _left, key);
-        }
-        
-        else if (_node -> _right && _node -> _key < key){
-            return _find(_node -> _right, key);
-        }
-        
-        else if (_node -> _key != key){
-            return nodepntr(nullptr);
-            
-        }
-        else{
-            return _node;
-        }
-        
+        nodepntr found;
+        _walk([&](const nodepntr& n) {
+            int dir = _direction(key, n);
+            if (dir == 0)
+                found = n;
+            return dir < 0 ? n -> _left : dir > 0 ? n -> _right : nodepntr(nullptr);
+        });
+        return found;
     }
     
-    nodepntr removeMin(nodepntr _node)
+    // smallest node with a key not less than key
+    nodepntr _ceiling(const key_type& key)
     {
-        if( _node -> _left == 0 )
-            return _node -> _right;
-        
-        _node -> _left = removeMin(_node -> _left);
-        return balance(_node);
+        nodepntr best;
+        _walk([&](const nodepntr& n) {
+            if (!(n -> _key < key)) {
+                best = n;
+                return n -> _left;
+            }
+            return n -> _right;
+        });
+        return best;
     }
     
-    nodepntr _remove(nodepntr _node, key_type key)
+    // smallest node with a key greater than key
+    nodepntr _successor(const key_type& key)
     {
-        
-        if (!_node){
-            return nodepntr(nullptr);
-        }
-        
-        else if( key < _node -> _key ){
-            _node -> _left = _remove( _node -> _left, key);
-        }
-        
-        else if( key > _node -> _key ){
-            _node -> _right = _remove( _node -> _right, key);
-        }
-        
-        else
-        {
-            nodepntr q = _node -> _left;
-            nodepntr r = _node -> _right;
-            
-            _node -> deleted = true;
-            
-            if (!r){
-                return q;
+        nodepntr best;
+        _walk([&](const nodepntr& n) {
+            if (key < n -> _key) {
+                best = n;
+                return n -> _left;
             }
-            
-            nodepntr min = findMin(r);
-            min -> _right = removeMin(r);
-            min -> _left = q;
-            return balance(min);
-        }
-        
-        return balance(_node);
+            return n -> _right;
+        });
+        return best;
+    }
+    
+    // largest node with a key less than key
+    nodepntr _predecessor(const key_type& key)
+    {
+        nodepntr best;
+        _walk([&](const nodepntr& n) {
+            if (n -> _key < key) {
+                best = n;
+                return n -> _right;
+            }
+            return n -> _left;
+        });
+        return best;
     }
 };
@@ -0,0 +1,615 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "epoch_reclaimer.h"
+#include "sharded_counter.h"
+#include "RWSpinLock.h"
+
+using std::unique_lock;
+
+/*
+ Optimistic concurrent AVL tree after Bronson, Casper, Chafi and Olukotun,
+ "A Practical Concurrent Binary Search Tree". Every node carries a version
+ word that changes whenever the node is rotated down ("shrinks") or
+ unlinked. Readers take no locks: they remember a node's version before
+ moving to a child and re-check it afterwards, retrying from the last
+ still valid node if it changed. Writers lock only the nodes they relink.
+ 
+ Removing a node with two children just drops its value and leaves it in
+ place as a routing node, so no successor has to be moved. Heights are
+ fixed after the update with the same few locks (relaxed balancing); a
+ routing node that ends up with at most one child is spliced out then.
+ Unlinked nodes and replaced values are freed through an epoch reclaimer.
+*/
+template<typename key_type, typename value_type, typename lock_type = RWSpinLock>
+class optimistic_avl_tree
+{
+    static constexpr std::uint64_t unlinked = 1;
+    static constexpr std::uint64_t shrinking = 2;
+    static constexpr std::uint64_t shrink_count = 4;
+    
+    struct node
+    {
+        const key_type _key;
+        std::atomic<value_type*> _value;
+        std::atomic<int> _height;
+        std::atomic<std::uint64_t> _version;
+        std::atomic<node*> _parent;
+        std::atomic<node*> _left;
+        std::atomic<node*> _right;
+        lock_type mut;
+        
+        node(const key_type& key, value_type* value, node* parent)
+        : _key(key), _value(value), _height(1), _version(0), _parent(parent), _left(nullptr), _right(nullptr)
+        {}
+        
+        node* child(int dir) const
+        {
+            return dir < 0 ? _left.load() : _right.load();
+        }
+        
+        void set_child(int dir, node* n)
+        {
+            if (dir < 0)
+                _left = n;
+            else
+                _right = n;
+        }
+        
+        // bounded spin, then yield, until the rotation that set shrinking is over
+        void wait_until_shrunk(std::uint64_t version) const
+        {
+            if (!(version & shrinking))
+                return;
+            for (int i = 0; i < 100 && _version.load() == version; i++) {}
+            while (_version.load() == version)
+                std::this_thread::yield();
+        }
+    };
+    
+    // yes means found for lookups and changed for updates
+    enum class result { retry, no, yes };
+    
+    // results of _condition besides a new height
+    static constexpr int unlink_required = -1;
+    static constexpr int rebalance_required = -2;
+    static constexpr int nothing_required = -3;
+    
+    // the root is the right child of this holder, so the root has a parent to lock
+    node _holder;
+    sharded_counter _size;
+    epoch_reclaimer _reclaimer;
+
+public:
+    
+    optimistic_avl_tree() : _holder(key_type(), nullptr, nullptr)
+    {}
+    
+    optimistic_avl_tree(const optimistic_avl_tree&) = delete;
+    optimistic_avl_tree& operator=(const optimistic_avl_tree&) = delete;
+    
+    ~optimistic_avl_tree()
+    {
+        std::vector<node*> stack;
+        if (node* root = _holder._right.load())
+            stack.push_back(root);
+        while (!stack.empty()) {
+            node* n = stack.back();
+            stack.pop_back();
+            if (n -> _left.load())
+                stack.push_back(n -> _left.load());
+            if (n -> _right.load())
+                stack.push_back(n -> _right.load());
+            delete n -> _value.load();
+            delete n;
+        }
+    }
+    
+    size_t size() const
+    {
+        return _size.sum();
+    }
+    
+    // cheap, may lag the exact size by a few dozen per thread
+    size_t approx_size() const
+    {
+        return _size.approx();
+    }
+    
+    bool empty() const
+    {
+        return _size.sum() == 0;
+    }
+    
+    bool find(const key_type& key, value_type& value)
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        while (true) {
+            node* root = _holder._right.load();
+            if (!root)
+                return false;
+            
+            int dir = _direction(key, root);
+            if (dir == 0)
+                return _read(root, value);
+            
+            std::uint64_t version = root -> _version.load();
+            if (version & (shrinking | unlinked)) {
+                root -> wait_until_shrunk(version);
+            } else if (root == _holder._right.load()) {
+                result r = _attempt_get(key, root, dir, version, value);
+                if (r != result::retry)
+                    return r == result::yes;
+            }
+        }
+    }
+    
+    bool contains(const key_type& key)
+    {
+        value_type value;
+        return find(key, value);
+    }
+    
+    // inserts if the key is absent, an existing value is kept
+    bool insert(const key_type& key, const value_type& value)
+    {
+        return _update(key, new value_type(value));
+    }
+    
+    bool remove(const key_type& key)
+    {
+        return _update(key, nullptr);
+    }
+    
+    /*
+     visits the elements in increasing key order; concurrent updates may
+     or may not be seen, and keys a rotation brings back are skipped
+    */
+    template<typename Func>
+    void for_each(Func f)
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        node* n = _holder._right.load();
+        std::vector<node*> stack;
+        const node* last = nullptr;
+        while (n || !stack.empty()) {
+            while (n) {
+                stack.push_back(n);
+                n = n -> _left.load();
+            }
+            n = stack.back();
+            stack.pop_back();
+            value_type value;
+            if ((!last || last -> _key < n -> _key) && _read(n, value)) {
+                f(n -> _key, value);
+                last = n;
+            }
+            n = n -> _right.load();
+        }
+    }
+
+private:
+    
+    static int _direction(const key_type& key, const node* n)
+    {
+        if (key < n -> _key)
+            return -1;
+        if (n -> _key < key)
+            return 1;
+        return 0;
+    }
+    
+    static int _height(const node* n)
+    {
+        return n ? n -> _height.load() : 0;
+    }
+    
+    // routing nodes carry no value
+    static bool _read(const node* n, value_type& value)
+    {
+        value_type* v = n -> _value.load();
+        if (!v)
+            return false;
+        value = *v;
+        return true;
+    }
+    
+    result _attempt_get(const key_type& key, node* n, int dir, std::uint64_t version, value_type& value)
+    {
+        while (true) {
+            node* child = n -> child(dir);
+            if (!child) {
+                if (n -> _version.load() != version)
+                    return result::retry;
+                return result::no;
+            }
+            
+            int child_dir = _direction(key, child);
+            if (child_dir == 0)
+                return _read(child, value) ? result::yes : result::no;
+            
+            std::uint64_t child_version = child -> _version.load();
+            if (child_version & (shrinking | unlinked)) {
+                child -> wait_until_shrunk(child_version);
+                if (n -> _version.load() != version)
+                    return result::retry;
+            } else if (child != n -> child(dir)) {
+                if (n -> _version.load() != version)
+                    return result::retry;
+            } else {
+                if (n -> _version.load() != version)
+                    return result::retry;
+                result r = _attempt_get(key, child, child_dir, child_version, value);
+                if (r != result::retry)
+                    return r;
+            }
+        }
+    }
+    
+    // value == nullptr removes; the value is owned by the tree afterwards
+    bool _update(const key_type& key, value_type* value)
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        while (true) {
+            node* root = _holder._right.load();
+            if (!root) {
+                if (!value)
+                    return false;
+                
+                unique_lock<lock_type> lock (_holder.mut);
+                if (!_holder._right.load()) {
+                    _holder._right = new node(key, value, &_holder);
+                    _holder._height = 2;
+                    _size.increment();
+                    return true;
+                }
+            } else {
+                std::uint64_t version = root -> _version.load();
+                if (version & (shrinking | unlinked)) {
+                    root -> wait_until_shrunk(version);
+                } else if (root == _holder._right.load()) {
+                    result r = _attempt_update(key, value, &_holder, root, version);
+                    if (r != result::retry) {
+                        if (r == result::no)
+                            delete value;
+                        return r == result::yes;
+                    }
+                }
+            }
+        }
+    }
+    
+    result _attempt_update(const key_type& key, value_type* value, node* parent, node* n, std::uint64_t version)
+    {
+        int dir = _direction(key, n);
+        if (dir == 0)
+            return _attempt_node_update(value, parent, n);
+        
+        while (true) {
+            node* child = n -> child(dir);
+            if (n -> _version.load() != version)
+                return result::retry;
+            
+            if (!child) {
+                if (!value)
+                    return result::no;
+                
+                node* damaged;
+                {
+                    unique_lock<lock_type> lock (n -> mut);
+                    // with n locked no rotation can move it any more
+                    if (n -> _version.load() != version)
+                        return result::retry;
+                    if (n -> child(dir))
+                        continue;
+                    
+                    n -> set_child(dir, new node(key, value, n));
+                    _size.increment();
+                    damaged = _fix_height(n);
+                }
+                _fix_height_and_rebalance(damaged);
+                return result::yes;
+            }
+            
+            std::uint64_t child_version = child -> _version.load();
+            if (child_version & (shrinking | unlinked)) {
+                child -> wait_until_shrunk(child_version);
+            } else if (child == n -> child(dir)) {
+                if (n -> _version.load() != version)
+                    return result::retry;
+                result r = _attempt_update(key, value, n, child, child_version);
+                if (r != result::retry)
+                    return r;
+            }
+        }
+    }
+    
+    result _attempt_node_update(value_type* value, node* parent, node* n)
+    {
+        if (!value) {
+            if (!n -> _value.load())
+                return result::no;
+            
+            if (!n -> _left.load() || !n -> _right.load()) {
+                // the node can be spliced out, which needs its parent as well
+                node* damaged;
+                {
+                    unique_lock<lock_type> parent_lock (parent -> mut);
+                    if ((parent -> _version.load() & unlinked) || n -> _parent.load() != parent)
+                        return result::retry;
+                    
+                    unique_lock<lock_type> lock (n -> mut);
+                    value_type* old = n -> _value.load();
+                    if (!old)
+                        return result::no;
+                    if (!_attempt_unlink(parent, n))
+                        return result::retry;
+                    _reclaimer.retire(old);
+                    damaged = _fix_height(parent);
+                }
+                _size.decrement();
+                _fix_height_and_rebalance(damaged);
+                return result::yes;
+            }
+        }
+        
+        unique_lock<lock_type> lock (n -> mut);
+        if (n -> _version.load() & unlinked)
+            return result::retry;
+        
+        value_type* old = n -> _value.load();
+        if (value) {
+            if (old)
+                return result::no;
+            n -> _value = value;
+            _size.increment();
+            return result::yes;
+        }
+        
+        if (!old)
+            return result::no;
+        // a child appeared or went away meanwhile, take the path that fits now
+        if (!n -> _left.load() || !n -> _right.load())
+            return result::retry;
+        n -> _value = nullptr;
+        _reclaimer.retire(old);
+        _size.decrement();
+        return result::yes;
+    }
+    
+    // parent and n are locked, parent is linked
+    bool _attempt_unlink(node* parent, node* n)
+    {
+        node* parent_left = parent -> _left.load();
+        node* parent_right = parent -> _right.load();
+        if (parent_left != n && parent_right != n)
+            return false;
+        
+        node* left = n -> _left.load();
+        node* right = n -> _right.load();
+        if (left && right)
+            return false;
+        
+        node* splice = left ? left : right;
+        if (parent_left == n)
+            parent -> _left = splice;
+        else
+            parent -> _right = splice;
+        if (splice)
+            splice -> _parent = parent;
+        
+        n -> _version = unlinked;
+        n -> _value = nullptr;
+        _reclaimer.retire(n);
+        return true;
+    }
+    
+    /*
+     What n needs, read without locks. A thread that changes a node
+     promises to fix it afterwards, so a racy "nothing" is still correct.
+    */
+    int _condition(node* n)
+    {
+        node* left = n -> _left.load();
+        node* right = n -> _right.load();
+        if ((!left || !right) && !n -> _value.load())
+            return unlink_required;
+        
+        int h = n -> _height.load();
+        int hl = _height(left);
+        int hr = _height(right);
+        int repl = 1 + (hl > hr ? hl : hr);
+        int bal = hl - hr;
+        if (bal < -1 || bal > 1)
+            return rebalance_required;
+        return h != repl ? repl : nothing_required;
+    }
+    
+    // n is locked; returns the next node to repair, or null
+    node* _fix_height(node* n)
+    {
+        int c = _condition(n);
+        if (c == rebalance_required || c == unlink_required)
+            return n;
+        if (c == nothing_required)
+            return nullptr;
+        n -> _height = c;
+        return n -> _parent.load();
+    }
+    
+    /*
+     Repairs run up to the root: a rotation hands back its deepest damaged
+     node, and the walk up from there also reaches the rotated parent.
+    */
+    void _fix_height_and_rebalance(node* n)
+    {
+        while (n && n -> _parent.load()) {
+            if (n -> _version.load() & unlinked)
+                return;
+            
+            int c = _condition(n);
+            if (c == nothing_required) {
+                n = n -> _parent.load();
+            } else if (c != unlink_required && c != rebalance_required) {
+                unique_lock<lock_type> lock (n -> mut);
+                node* next = _fix_height(n);
+                n = next ? next : n -> _parent.load();
+            } else {
+                node* parent = n -> _parent.load();
+                unique_lock<lock_type> parent_lock (parent -> mut);
+                if (!(parent -> _version.load() & unlinked) && n -> _parent.load() == parent) {
+                    unique_lock<lock_type> lock (n -> mut);
+                    node* next = _rebalance(parent, n);
+                    n = next ? next : parent;
+                }
+            }
+        }
+    }
+    
+    // parent and n are locked
+    node* _rebalance(node* parent, node* n)
+    {
+        node* left = n -> _left.load();
+        node* right = n -> _right.load();
+        if ((!left || !right) && !n -> _value.load()) {
+            if (_attempt_unlink(parent, n))
+                return _fix_height(parent);
+            return n;
+        }
+        
+        int h = n -> _height.load();
+        int hl = _height(left);
+        int hr = _height(right);
+        int repl = 1 + (hl > hr ? hl : hr);
+        int bal = hl - hr;
+        if (bal > 1)
+            return _rebalance_heavy(parent, n, -1, left, hr);
+        if (bal < -1)
+            return _rebalance_heavy(parent, n, 1, right, hl);
+        if (repl != h) {
+            n -> _height = repl;
+            return _fix_height(parent);
+        }
+        return nullptr;
+    }
+    
+    /*
+     n leans towards side heavy, whose child is locked here; h_light is
+     the height on the other side. A single rotation is used when the
+     outer grandchild is the taller one, a double rotation otherwise.
+    */
+    node* _rebalance_heavy(node* parent, node* n, int heavy, node* child, int h_light)
+    {
+        unique_lock<lock_type> child_lock (child -> mut);
+        int hc = child -> _height.load();
+        if (hc - h_light <= 1)
+            return n;
+        
+        node* inner = child -> child(-heavy);
+        int h_outer = _height(child -> child(heavy));
+        int h_inner = _height(inner);
+        if (h_outer >= h_inner)
+            return _rotate(parent, n, heavy, child, h_light, h_outer, inner, h_inner);
+        
+        {
+            unique_lock<lock_type> inner_lock (inner -> mut);
+            h_inner = inner -> _height.load();
+            if (h_outer >= h_inner)
+                return _rotate(parent, n, heavy, child, h_light, h_outer, inner, h_inner);
+            
+            int h_inner_outer = _height(inner -> child(heavy));
+            int b = h_outer - h_inner_outer;
+            if (b >= -1 && b <= 1)
+                return _rotate_double(parent, n, heavy, child, h_light, h_outer, inner, h_inner_outer);
+        }
+        // child would stay unbalanced, fix it (or what is below it) first
+        node* next = _rebalance_heavy(n, child, -heavy, inner, h_outer);
+        return next == child ? inner : next;
+    }
+    
+    // single rotation: child takes n's place, n moves down to the light side
+    node* _rotate(node* parent, node* n, int heavy, node* child, int h_light, int h_outer, node* inner, int h_inner)
+    {
+        std::uint64_t version = n -> _version.load();
+        node* parent_left = parent -> _left.load();
+        n -> _version = version | shrinking;
+        
+        n -> set_child(heavy, inner);
+        if (inner)
+            inner -> _parent = n;
+        child -> set_child(-heavy, n);
+        n -> _parent = child;
+        if (parent_left == n)
+            parent -> _left = child;
+        else
+            parent -> _right = child;
+        child -> _parent = parent;
+        
+        int h_n = 1 + (h_inner > h_light ? h_inner : h_light);
+        n -> _height = h_n;
+        child -> _height = 1 + (h_outer > h_n ? h_outer : h_n);
+        n -> _version = version + shrink_count;
+        
+        if (_condition(n) != nothing_required)
+            return n;
+        if (_condition(child) != nothing_required)
+            return child;
+        return _fix_height(parent);
+    }
+    
+    // double rotation: inner takes n's place with child and n below it
+    node* _rotate_double(node* parent, node* n, int heavy, node* child, int h_light, int h_outer, node* inner, int h_inner_outer)
+    {
+        std::uint64_t version = n -> _version.load();
+        std::uint64_t child_version = child -> _version.load();
+        node* parent_left = parent -> _left.load();
+        node* inner_outer = inner -> child(heavy);
+        node* inner_inner = inner -> child(-heavy);
+        int h_inner_inner = _height(inner_inner);
+        
+        n -> _version = version | shrinking;
+        child -> _version = child_version | shrinking;
+        
+        n -> set_child(heavy, inner_inner);
+        if (inner_inner)
+            inner_inner -> _parent = n;
+        child -> set_child(-heavy, inner_outer);
+        if (inner_outer)
+            inner_outer -> _parent = child;
+        inner -> set_child(heavy, child);
+        child -> _parent = inner;
+        inner -> set_child(-heavy, n);
+        n -> _parent = inner;
+        if (parent_left == n)
+            parent -> _left = inner;
+        else
+            parent -> _right = inner;
+        inner -> _parent = parent;
+        
+        int h_n = 1 + (h_inner_inner > h_light ? h_inner_inner : h_light);
+        n -> _height = h_n;
+        int h_child = 1 + (h_outer > h_inner_outer ? h_outer : h_inner_outer);
+        child -> _height = h_child;
+        inner -> _height = 1 + (h_child > h_n ? h_child : h_n);
+        
+        n -> _version = version + shrink_count;
+        child -> _version = child_version + shrink_count;
+        
+        // n is the only damage the caller can still reach, so a routing child
+        // left with one subtree is spliced out while inner is held
+        if (!child -> _value.load() && (!child -> _left.load() || !child -> _right.load()) && _attempt_unlink(inner, child)) {
+            h_child = _height(inner -> child(heavy));
+            inner -> _height = 1 + (h_child > h_n ? h_child : h_n);
+        }
+        
+        if (_condition(n) != nothing_required)
+            return n;
+        if (_condition(inner) != nothing_required)
+            return inner;
+        return _fix_height(parent);
+    }
+};
@@ -0,0 +1,473 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "epoch_reclaimer.h"
+#include "sharded_counter.h"
+
+/*
+ Lock-free skiplist map after Fraser and Herlihy-Shavit. Every level is a
+ sorted linked list whose links carry a mark bit; marking a node's own
+ links removes it logically, and anyone who walks past a marked node
+ snips it out with one compare-and-swap. A node is in the map while its
+ bottom link is unmarked, so the mark there is the point of removal, and
+ the upper levels are only shortcuts.
+ 
+ Readers never write. A node is freed through an epoch reclaimer once
+ both its inserter has finished linking it and its remover has unlinked
+ it. Iterators pin the epoch of the thread that made them, so they stay
+ valid across removals but must not move to another thread, and a long
+ lived one holds back reclamation.
+*/
+template<typename key_type, typename value_type>
+class skiplist_map
+{
+    static constexpr int max_level = 20;
+    static constexpr std::uintptr_t mark = 1;
+    
+    struct node
+    {
+        const key_type _key;
+        value_type _value;
+        const int _height;
+        // the inserter and the remover, the last one to let go retires the node
+        std::atomic<int> _owners;
+        std::atomic<std::uintptr_t>* _next;
+        
+        node(const key_type& key, const value_type& value, int height)
+        : _key(key), _value(value), _height(height), _owners(2),
+        _next(new std::atomic<std::uintptr_t>[height])
+        {
+            for (int i = 0; i < height; i++)
+                _next[i].store(0, std::memory_order_relaxed);
+        }
+        
+        ~node()
+        {
+            delete[] _next;
+        }
+        
+        bool removed() const
+        {
+            return _next[0].load() & mark;
+        }
+    };
+    
+    enum class result { retry, no, yes };
+    
+    node* _head;
+    sharded_counter _size;
+    mutable epoch_reclaimer _reclaimer;
+    
+public:
+    
+    class Iterator
+    {
+        friend skiplist_map;
+        node* _node;
+        const skiplist_map* _owner;
+        
+        void _pin()
+        {
+            if (_owner)
+                _owner -> _reclaimer.enter();
+        }
+        
+        void _unpin()
+        {
+            if (_owner)
+                _owner -> _reclaimer.exit();
+        }
+    
+    public:
+        explicit Iterator(node* n = nullptr, const skiplist_map* owner = nullptr)
+        : _node(n), _owner(n ? owner : nullptr)
+        {
+            _pin();
+        }
+        
+        Iterator(const Iterator& rhs) : _node(rhs._node), _owner(rhs._owner)
+        {
+            _pin();
+        }
+        
+        Iterator& operator=(const Iterator& rhs)
+        {
+            if (this != &rhs) {
+                _unpin();
+                _node = rhs._node;
+                _owner = rhs._owner;
+                _pin();
+            }
+            return *this;
+        }
+        
+        ~Iterator()
+        {
+            _unpin();
+        }
+        
+        bool operator==(const Iterator& rhs) const
+        {
+            return _node == rhs._node;
+        }
+        
+        bool operator!=(const Iterator& rhs) const
+        {
+            return _node != rhs._node;
+        }
+        
+        const value_type& value() const
+        {
+            return _node -> _value;
+        }
+        
+        const value_type& operator*() const
+        {
+            return value();
+        }
+        
+        const key_type& key() const
+        {
+            return _node -> _key;
+        }
+        
+        // links of a removed node still lead forward, so this works from one too
+        Iterator& operator++()
+        {
+            if (!_node)
+                return *this;
+            do {
+                _node = _address(_node -> _next[0].load());
+            } while (_node && _node -> removed());
+            if (!_node)
+                _unpin_end();
+            return *this;
+        }
+        
+        const Iterator operator++(int)
+        {
+            Iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+        
+        // the lists are singly linked, so this searches from the head
+        Iterator& operator--()
+        {
+            if (!_node)
+                return *this;
+            node* prev = _owner -> _predecessor(_node -> _key);
+            _node = prev;
+            if (!_node)
+                _unpin_end();
+            return *this;
+        }
+        
+        const Iterator operator--(int)
+        {
+            Iterator tmp = *this;
+            --(*this);
+            return tmp;
+        }
+    
+    private:
+        void _unpin_end()
+        {
+            _unpin();
+            _owner = nullptr;
+        }
+    };
+    
+    skiplist_map() : _head(new node(key_type(), value_type(), max_level))
+    {}
+    
+    skiplist_map(const skiplist_map&) = delete;
+    skiplist_map& operator=(const skiplist_map&) = delete;
+    
+    // no thread may use the map any more, removed nodes are already off level 0
+    ~skiplist_map()
+    {
+        node* n = _head;
+        while (n) {
+            node* next = _address(n -> _next[0].load());
+            delete n;
+            n = next;
+        }
+    }
+    
+    Iterator begin() const
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        node* n = _address(_head -> _next[0].load());
+        while (n && n -> removed())
+            n = _address(n -> _next[0].load());
+        return Iterator(n, this);
+    }
+    
+    Iterator end() const
+    {
+        return Iterator();
+    }
+    
+    size_t size() const
+    {
+        return _size.sum();
+    }
+    
+    // cheap, may lag the exact size by a few dozen per thread
+    size_t approx_size() const
+    {
+        return _size.approx();
+    }
+    
+    bool empty() const
+    {
+        return _size.sum() == 0;
+    }
+    
+    void clear()
+    {
+        for (auto it = begin(); it != end(); it = begin())
+            remove(it);
+    }
+    
+    // inserts if the key is absent; either way the iterator points to the key
+    Iterator insert(const key_type& key, const value_type& value)
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        node* preds[max_level];
+        node* succs[max_level];
+        node* nd = nullptr;
+        while (true) {
+            if (_find(key, preds, succs)) {
+                delete nd;
+                return Iterator(succs[0], this);
+            }
+            if (!nd)
+                nd = new node(key, value, _random_height());
+            
+            for (int level = 0; level < nd -> _height; level++)
+                nd -> _next[level].store(_pointer(succs[level]), std::memory_order_relaxed);
+            
+            std::uintptr_t expected = _pointer(succs[0]);
+            if (preds[0] -> _next[0].compare_exchange_strong(expected, _pointer(nd)))
+                break;
+        }
+        _size.increment();
+        Iterator res(nd, this);
+        
+        _link_upper(nd, preds, succs);
+        // a removal that overlapped the linking may have missed a level
+        if (nd -> removed())
+            _find(key, preds, succs);
+        _release(nd);
+        return res;
+    }
+    
+    bool remove(const key_type& key)
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        node* preds[max_level];
+        node* succs[max_level];
+        while (true) {
+            if (!_find(key, preds, succs))
+                return false;
+            // lost to another remover, the key may have come back since
+            if (_remove(succs[0]))
+                return true;
+        }
+    }
+    
+    // removes the very element the iterator points to, false if it is gone already
+    bool remove(Iterator pos)
+    {
+        if (!pos._node)
+            return false;
+        epoch_reclaimer::guard guard(_reclaimer);
+        return _remove(pos._node);
+    }
+    
+    Iterator find(const key_type& key) const
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        node* n = _lower_bound(key);
+        if (n && !(key < n -> _key))
+            return Iterator(n, this);
+        return end();
+    }
+    
+    // the first element not less than key
+    Iterator lower_bound(const key_type& key) const
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        return Iterator(_lower_bound(key), this);
+    }
+    
+    // the first element greater than key
+    Iterator upper_bound(const key_type& key) const
+    {
+        Iterator it = lower_bound(key);
+        if (it != end() && !(key < it.key()))
+            ++it;
+        return it;
+    }
+    
+    /*
+     visits the elements with from <= key < to in increasing order;
+     concurrent updates may or may not be seen
+    */
+    template<typename Func>
+    void for_range(const key_type& from, const key_type& to, Func f) const
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        for (node* n = _lower_bound(from); n && n -> _key < to; n = _address(n -> _next[0].load())) {
+            if (!n -> removed())
+                f(n -> _key, n -> _value);
+        }
+    }
+    
+    // the one writable access to a value; it races with other writers of the same key
+    value_type& operator[](const key_type& key)
+    {
+        auto res = insert(key, value_type());
+        return res._node -> _value;
+    }
+
+private:
+    
+    static node* _address(std::uintptr_t field)
+    {
+        return reinterpret_cast<node*>(field & ~mark);
+    }
+    
+    static std::uintptr_t _pointer(node* n)
+    {
+        return reinterpret_cast<std::uintptr_t>(n);
+    }
+    
+    // geometric with p = 1/2
+    static int _random_height()
+    {
+        static thread_local std::uint32_t state = 2463534242u ^ static_cast<std::uint32_t>(
+            reinterpret_cast<std::uintptr_t>(&state));
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        int height = 1;
+        for (std::uint32_t bits = state; (bits & 1) && height < max_level; bits >>= 1)
+            height++;
+        return height;
+    }
+    
+    // fills preds and succs on every level, snipping out marked nodes on the way
+    result _try_find(const key_type& key, node** preds, node** succs)
+    {
+        node* pred = _head;
+        for (int level = max_level - 1; level >= 0; level--) {
+            node* curr = _address(pred -> _next[level].load());
+            while (curr) {
+                std::uintptr_t succ = curr -> _next[level].load();
+                if (succ & mark) {
+                    std::uintptr_t expected = _pointer(curr);
+                    if (!pred -> _next[level].compare_exchange_strong(expected, succ & ~mark))
+                        return result::retry;
+                    curr = _address(succ);
+                    continue;
+                }
+                if (!(curr -> _key < key))
+                    break;
+                pred = curr;
+                curr = _address(succ);
+            }
+            preds[level] = pred;
+            succs[level] = curr;
+        }
+        return succs[0] && !(key < succs[0] -> _key) ? result::yes : result::no;
+    }
+    
+    bool _find(const key_type& key, node** preds, node** succs)
+    {
+        result r;
+        while ((r = _try_find(key, preds, succs)) == result::retry) {}
+        return r == result::yes;
+    }
+    
+    // a pure read: steps over marked nodes instead of snipping them
+    node* _lower_bound(const key_type& key) const
+    {
+        node* pred = _head;
+        node* curr = nullptr;
+        for (int level = max_level - 1; level >= 0; level--) {
+            curr = _address(pred -> _next[level].load());
+            while (curr) {
+                std::uintptr_t succ = curr -> _next[level].load();
+                if (!(succ & mark)) {
+                    if (!(curr -> _key < key))
+                        break;
+                    pred = curr;
+                }
+                curr = _address(succ);
+            }
+        }
+        return curr;
+    }
+    
+    node* _predecessor(const key_type& key) const
+    {
+        epoch_reclaimer::guard guard(_reclaimer);
+        node* pred = _head;
+        for (int level = max_level - 1; level >= 0; level--) {
+            node* curr = _address(pred -> _next[level].load());
+            while (curr && curr -> _key < key) {
+                if (!(curr -> _next[level].load() & mark))
+                    pred = curr;
+                curr = _address(curr -> _next[level].load());
+            }
+        }
+        return pred == _head ? nullptr : pred;
+    }
+    
+    // links nd above level 0, giving up once a remover has marked it
+    void _link_upper(node* nd, node** preds, node** succs)
+    {
+        for (int level = 1; level < nd -> _height; level++) {
+            while (true) {
+                std::uintptr_t next = nd -> _next[level].load();
+                if (next & mark)
+                    return;
+                if (_address(next) != succs[level] &&
+                    !nd -> _next[level].compare_exchange_strong(next, _pointer(succs[level])))
+                    continue;
+                
+                std::uintptr_t expected = _pointer(succs[level]);
+                if (preds[level] -> _next[level].compare_exchange_strong(expected, _pointer(nd)))
+                    break;
+                if (!_find(nd -> _key, preds, succs) || succs[0] != nd)
+                    return;
+            }
+        }
+    }
+    
+    // marks every level top-down; whoever marks level 0 has removed the node
+    bool _remove(node* victim)
+    {
+        for (int level = victim -> _height - 1; level > 0; level--)
+            victim -> _next[level].fetch_or(mark);
+        if (victim -> _next[0].fetch_or(mark) & mark)
+            return false;
+        
+        _size.decrement();
+        node* preds[max_level];
+        node* succs[max_level];
+        _find(victim -> _key, preds, succs);
+        _release(victim);
+        return true;
+    }
+    
+    void _release(node* n)
+    {
+        if (n -> _owners.fetch_sub(1) == 1)
+            _reclaimer.retire(n);
+    }
+};
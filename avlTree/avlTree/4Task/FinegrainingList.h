@@ -3,6 +3,9 @@
 #include <iostream>
 #include <thread>
 #include <shared_mutex>
+
+#include "sharded_counter.h"
+#include "thread_pool.h"
 #include <cassert>
 
 using std::shared_timed_mutex;
@@ -74,17 +77,32 @@ class List
         
         using binNode = BinNode<value_type>;
         
-        std::thread personalThread;
+        /*
+         Nodes are freed in passes on the shared thread_pool. A pass is
+         queued once collect_every nodes wait, and the list's destructor
+         runs whatever is left.
+        */
+        static constexpr std::uint32_t collect_every = 64;
+        
         std::atomic<binNode*> start;
         List* list_pointer;
-        bool terminated = false;
+        // deleteNode calls not yet covered by a pass; at collect_every or above a pass is queued or running
+        std::atomic<std::uint32_t> pending = {0};
+        std::atomic<bool> terminated = {false};
         
-        Bin(List* list) : list_pointer(list), start(nullptr), personalThread(&Bin::sleepPThread, this)
+        Bin(List* list) : start(nullptr), list_pointer(list)
         {}
         
         ~Bin() {
+            while (pending.load() >= collect_every) {
+                if (!thread_pool::shared().run_one())
+                    std::this_thread::yield();
+            }
+            
+            // only this thread is left, the passes below must not queue more
             terminated = true;
-            personalThread.join();
+            while (start.load() != nullptr)
+                collectPass();
         }
         
         void freeNode(binNode* node) {
@@ -112,77 +130,86 @@ class List
             do {
                 node -> _right = start.load();
             } while (!start.compare_exchange_strong(node -> _right, node));
+            
+            if (++pending == collect_every && !terminated)
+                thread_pool::shared().submit([this] { collect(); });
         }
         
+        // one pass at a time: pending stays at collect_every or above until the last one ends
+        void collect() {
+            std::uint32_t seen = pending.load();
+            while (true) {
+                collectPass();
+                std::uint32_t left = pending.fetch_sub(seen) - seen;
+                if (left < collect_every)
+                    return;
+                seen = left;
+            }
+        }
         
-        void sleepPThread() {
-            do {
-                // первая стадия
-                unique_lock<shared_timed_mutex> lock(list_pointer -> list_mut);
-                
-                binNode* binStart = this -> start;
-                
-                lock.unlock();
+        
+        void collectPass() {
+            // первая стадия
+            unique_lock<shared_timed_mutex> lock(list_pointer -> list_mut);
+            
+            binNode* binStart = this -> start;
+            
+            lock.unlock();
+            
+            if (binStart != nullptr) {
                 
-                if (binStart != nullptr) {
-                    
-                    binNode* left = binStart;
-                    for (binNode* node = binStart; node != nullptr;) {
-                        
-                        binNode* tmp = node;
-                        node = node -> _right;
-                        
-                        if (tmp -> _data -> ref_count > 0 || tmp -> _data -> bin == 1) {
-                            remove(left, tmp);
-                        } else {
-                            tmp -> _data -> bin = 1;
-                            left = tmp;
-                        }
-                    }
-                    
-                    left -> _right = nullptr;
-                    
-                    // вторая стадия
+                binNode* left = binStart;
+                for (binNode* node = binStart; node != nullptr;) {
                     
-                    lock.lock();
+                    binNode* tmp = node;
+                    node = node -> _right;
                     
-                    binNode* newBinStart = this -> start;
-                    
-                    if (newBinStart == binStart) {
-                        // если после первой стадии нет новых нодов, то start освобождается
-                        
-                        this -> start = nullptr;
+                    if (tmp -> _data -> ref_count > 0 || tmp -> _data -> bin == 1) {
+                        remove(left, tmp);
+                    } else {
+                        tmp -> _data -> bin = 1;
+                        left = tmp;
                     }
+                }
+                
+                left -> _right = nullptr;
+                
+                // вторая стадия
+                
+                lock.lock();
+                
+                binNode* newBinStart = this -> start;
+                
+                if (newBinStart == binStart) {
+                    // если после первой стадии нет новых нодов, то start освобождается
                     
-                    lock.unlock();
-                    
-                    left = newBinStart;
-                    binNode* node = newBinStart;
-                    while (node != binStart) {
-                        binNode* tmp = node;
-                        node = node -> _right;
-                        
-                        if (tmp -> _data -> bin == 1) {
-                            remove(left, tmp);
-                        } else {
-                            left = tmp;
-                        }
-                    }
-                    left -> _right = nullptr;
-                    
+                    this -> start = nullptr;
+                }
+                
+                lock.unlock();
+                
+                left = newBinStart;
+                binNode* node = newBinStart;
+                while (node != binStart) {
+                    binNode* tmp = node;
+                    node = node -> _right;
                     
-                    for (binNode* node = binStart; node != nullptr; ) {
-                        binNode* tmp = node;
-                        node = node -> _right;
-                        
-                        freeNode(tmp);
+                    if (tmp -> _data -> bin == 1) {
+                        remove(left, tmp);
+                    } else {
+                        left = tmp;
                     }
                 }
+                left -> _right = nullptr;
+                
                 
-                if (!terminated) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                for (binNode* node = binStart; node != nullptr; ) {
+                    binNode* tmp = node;
+                    node = node -> _right;
+                    
+                    freeNode(tmp);
                 }
-            } while (!terminated || start.load() != nullptr);
+            }
         }
         
     };
@@ -316,7 +343,7 @@ public:
         last -> _left = nullptr;
         last -> _right = nullptr;
         
-        _size = 0;
+        _size.reset();
         
         Nod::receive(&first -> _right, last);
         Nod::receive(&last -> _left, first);
@@ -331,7 +358,7 @@ public:
         last -> _left = nullptr;
         last -> _right = nullptr;
         
-        _size = 0;
+        _size.reset();
         
         Nod::receive(&first -> _right, last);
         Nod::receive(&last -> _left, first);
@@ -400,7 +427,7 @@ public:
             prev->release(prev);
             next->release(next);
             
-            _size++;
+            _size.increment();
             
             
             // iter++
@@ -464,7 +491,7 @@ public:
                 node -> release(node);
                 node -> release(node);
                 
-                _size--;
+                _size.decrement();
                 
                 retry = false;
                 
@@ -495,17 +522,22 @@ public:
     }
     
     bool empty() {
-        return !_size;
+        return _size.sum() == 0;
     }
     
     unsigned long size() {
-        return _size;
+        return _size.sum();
+    }
+    
+    // cheap, may lag the exact size by a few dozen per thread
+    size_t approx_size() {
+        return _size.approx();
     }
     
 private:
     Nod* first;
     Nod* last;
-    std::atomic<std::size_t> _size = {0};
+    sharded_counter _size;
     std::shared_timed_mutex list_mut;
     Bin<value_type>* bin;
 };
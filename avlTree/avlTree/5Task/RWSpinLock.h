@@ -3,6 +3,8 @@
 #include <stdexcept>
 #include <thread>
 #include <shared_mutex>
+#include <atomic>
+#include <cstdint>
 
 
 struct RWSpinLock {
@@ -53,7 +55,20 @@ struct RWSpinLock {
         }
     }
     
+    // Lockable / SharedLockable names, so the lock works with unique_lock and shared_lock
+    void lock () {
+        wlock();
+    }
+    
+    void lock_shared () {
+        rlock();
+    }
+    
+    void unlock_shared () {
+        unlock();
+    }
+    
 private:
-    std::atomic<uint32_t> val;
-    uint32_t WBIT = 1 << 31;
+    std::atomic<uint32_t> val = {0};
+    static constexpr uint32_t WBIT = 1u << 31;
 };
@@ -4,20 +4,24 @@
 #include <thread>
 #include <shared_mutex>
 #include <cassert>
+#include <atomic>
+#include <mutex>
 
 #include "RWSpinLock.h"
+#include "sharded_counter.h"
+#include "thread_pool.h"
 
 using std::shared_timed_mutex;
 using std::unique_lock;
 using std::shared_lock;
 
-template <typename value_type>
+template <typename value_type, typename lock_type = RWSpinLock>
 class List
 {
     template <typename T>
     class Node {
     private:
-        template<typename U>
+        template<typename U, typename L>
         friend class List;
         
     public:
@@ -28,7 +32,7 @@ class List
         std::atomic<std::uint32_t> ref_count = {0};
         std::atomic<std::uint32_t> bin = {0};
 //        std::shared_timed_mutex mut;
-        RWSpinLock mut;
+        lock_type mut;
         bool deleted;
         
         Node(List* list) : _left(nullptr), _right(nullptr), list_pointer(list), deleted(false)
@@ -63,7 +67,7 @@ class List
     template <typename T>
     class Bin {
     private:
-        template<typename U>
+        template<typename U, typename L>
         friend class List;
         
     public:
@@ -81,17 +85,32 @@ class List
         
         using binNode = BinNode<value_type>;
         
-        std::thread personalThread;
+        /*
+         Nodes are freed in passes on the shared thread_pool. A pass is
+         queued once collect_every nodes wait, and the list's destructor
+         runs whatever is left.
+        */
+        static constexpr std::uint32_t collect_every = 64;
+        
         std::atomic<binNode*> start;
         List* list_pointer;
-        bool terminated = false;
+        // deleteNode calls not yet covered by a pass; at collect_every or above a pass is queued or running
+        std::atomic<std::uint32_t> pending = {0};
+        std::atomic<bool> terminated = {false};
         
-        Bin(List* list) : list_pointer(list), start(nullptr), personalThread(&Bin::sleepPThread, this)
+        Bin(List* list) : start(nullptr), list_pointer(list)
         {}
         
         ~Bin() {
+            while (pending.load() >= collect_every) {
+                if (!thread_pool::shared().run_one())
+                    std::this_thread::yield();
+            }
+            
+            // only this thread is left, the passes below must not queue more
             terminated = true;
-            personalThread.join();
+            while (start.load() != nullptr)
+                collectPass();
         }
         
         void freeNode(binNode* node) {
@@ -119,77 +138,86 @@ class List
             do {
                 node -> _right = start.load();
             } while (!start.compare_exchange_strong(node -> _right, node));
+            
+            if (++pending == collect_every && !terminated)
+                thread_pool::shared().submit([this] { collect(); });
         }
         
+        // one pass at a time: pending stays at collect_every or above until the last one ends
+        void collect() {
+            std::uint32_t seen = pending.load();
+            while (true) {
+                collectPass();
+                std::uint32_t left = pending.fetch_sub(seen) - seen;
+                if (left < collect_every)
+                    return;
+                seen = left;
+            }
+        }
         
-        void sleepPThread() {
-            do {
-                // первая стадия
-                list_pointer -> list_mut.wlock();
-                
-                binNode* binStart = this -> start;
-                
-                list_pointer -> list_mut.unlock();
+        
+        void collectPass() {
+            // первая стадия
+            list_pointer -> list_mut.wlock();
+            
+            binNode* binStart = this -> start;
+            
+            list_pointer -> list_mut.unlock();
+            
+            if (binStart != nullptr) {
                 
-                if (binStart != nullptr) {
-                    
-                    binNode* left = binStart;
-                    for (binNode* node = binStart; node != nullptr;) {
-                        
-                        binNode* tmp = node;
-                        node = node -> _right;
-                        
-                        if (tmp -> _data -> ref_count > 0 || tmp -> _data -> deleted) {
-                            remove(left, tmp);
-                        } else {
-                            tmp -> _data -> bin = 1;
-                            left = tmp;
-                        }
-                    }
-                    
-                    left -> _right = nullptr;
-                    
-                    // вторая стадия
-                    
-                    list_pointer -> list_mut.wlock();
+                binNode* left = binStart;
+                for (binNode* node = binStart; node != nullptr;) {
                     
-                    binNode* newBinStart = this -> start;
+                    binNode* tmp = node;
+                    node = node -> _right;
                     
-                    if (newBinStart == binStart) {
-                        // если после первой стадии нет новых нодов, то start освобождается
-                        
-                        start = nullptr;
+                    if (tmp -> _data -> ref_count > 0 || tmp -> _data -> deleted) {
+                        remove(left, tmp);
+                    } else {
+                        tmp -> _data -> bin = 1;
+                        left = tmp;
                     }
+                }
+                
+                left -> _right = nullptr;
+                
+                // вторая стадия
+                
+                list_pointer -> list_mut.wlock();
+                
+                binNode* newBinStart = this -> start;
+                
+                if (newBinStart == binStart) {
+                    // если после первой стадии нет новых нодов, то start освобождается
                     
-                    list_pointer -> list_mut.unlock();
-                    
-                    left = newBinStart;
-                    binNode* node = newBinStart;
-                    while (node != binStart) {
-                        binNode* tmp = node;
-                        node = node -> _right;
-                        
-                        if (tmp -> _data -> bin == 1) {
-                            remove(left, tmp);
-                        } else {
-                            left = tmp;
-                        }
-                    }
-                    left -> _right = nullptr;
-                    
+                    start = nullptr;
+                }
+                
+                list_pointer -> list_mut.unlock();
+                
+                left = newBinStart;
+                binNode* node = newBinStart;
+                while (node != binStart) {
+                    binNode* tmp = node;
+                    node = node -> _right;
                     
-                    for (binNode* node = binStart; node != nullptr; ) {
-                        binNode* tmp = node;
-                        node = node -> _right;
-                        
-                        freeNode(tmp);
+                    if (tmp -> _data -> bin == 1) {
+                        remove(left, tmp);
+                    } else {
+                        left = tmp;
                     }
                 }
+                left -> _right = nullptr;
+                
                 
-                if (!terminated) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                for (binNode* node = binStart; node != nullptr; ) {
+                    binNode* tmp = node;
+                    node = node -> _right;
+                    
+                    freeNode(tmp);
                 }
-            } while (!terminated || start.load() != nullptr);
+            }
         }
         
     };
@@ -199,7 +227,7 @@ public:
     class Iterator
     {
     private:
-        template<typename U>
+        template<typename U, typename L>
         friend class List;
     public:
         using Nod = Node<value_type>;
@@ -264,11 +292,11 @@ public:
         Iterator& operator++() {
             Nod* node = pointer;
             
-            list_pointer -> list_mut.reedLock();
+            list_pointer -> list_mut.rlock();
             
-            auto next_node = node -> next;
+            auto next_node = node -> _right;
             
-            value_type::acquire(&pointer, next_node);
+            Nod::receive(&pointer, next_node);
             
             list_pointer -> list_mut.unlock();
             
@@ -324,7 +352,7 @@ public:
         last -> _left = nullptr;
         last -> _right = nullptr;
         
-        _size = 0;
+        _size.reset();
         
         Nod::receive(&first -> _right, last);
         Nod::receive(&last -> _left, first);
@@ -339,7 +367,7 @@ public:
         last -> _left = nullptr;
         last -> _right = nullptr;
         
-        _size = 0;
+        _size.reset();
         
         Nod::receive(&first -> _right, last);
         Nod::receive(&last -> _left, first);
@@ -368,6 +396,7 @@ public:
         first -> mut.rlock();
         Nod* ret = first -> _right;
         Iter it = Iter(ret, this);
+        first -> mut.unlock();
         
         return it;
     }
@@ -409,7 +438,7 @@ public:
                 prev->release(prev); // ref_count >= 3
                 next->release(next);
                 
-                _size++;
+                _size.increment();
                 retry = false;
                 
                 // iter++
@@ -475,7 +504,7 @@ public:
                 node -> release(node);
                 node -> release(node);
                 
-                _size--;
+                _size.decrement();
                 
                 retry = false;
                 
@@ -506,17 +535,22 @@ public:
     }
     
     bool empty() {
-        return !_size;
+        return _size.sum() == 0;
     }
     
     unsigned long size() {
-        return _size;
+        return _size.sum();
+    }
+    
+    // cheap, may lag the exact size by a few dozen per thread
+    size_t approx_size() {
+        return _size.approx();
     }
     
 private:
     Nod* first;
     Nod* last;
-    std::atomic<std::size_t> _size = {0};
-    RWSpinLock list_mut;
+    sharded_counter _size;
+    lock_type list_mut;
     Bin<value_type>* bin;
 };
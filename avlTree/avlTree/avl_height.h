@@ -0,0 +1,10 @@
+#pragma once
+
+/*
+ Bits of a node's height field. An AVL tree of n nodes is less than
+ 1.45 log2(n) levels high, so 7 bits cover any tree that fits in memory
+ and the node's last flag (deleted, fresh) takes the eighth bit of the
+ same byte. Trees that let the balance slip, like the relaxed mode of
+ MediumGrainedTree, have to bound how far it slips.
+*/
+constexpr unsigned avl_height_bits = 7;
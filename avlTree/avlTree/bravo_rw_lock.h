@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <shared_mutex>
+#include <thread>
+
+#include "read_indicator.h"
+
+/*
+ Reader-biased wrapper over shared_timed_mutex (BRAVO). While the bias is
+ on, readers only mark their own slot in a read_indicator and never touch
+ the mutex. A writer turns the bias off, waits for the marked readers to
+ leave and then works under the plain mutex; the bias comes back after a
+ pause proportional to how long that revocation took.
+ Meets the SharedMutex requirements, so it can stand in for
+ shared_timed_mutex in unique_lock / shared_lock.
+*/
+class bravo_rw_lock {
+public:
+    void lock_shared() {
+        /*
+         A thread already counted in its slot holds the lock, and a writer
+         cannot get past it. Going to the mutex would deadlock against a
+         writer that waits for this very slot, so nested reads count again.
+        */
+        if (_readers.present()) {
+            _readers.arrive();
+            return;
+        }
+        if (_rbias.load(std::memory_order_acquire) && _readers.arrive()) {
+            if (_rbias.load(std::memory_order_seq_cst))
+                return;
+            _readers.depart();
+        }
+        
+        _mutex.lock_shared();
+        if (!_rbias.load(std::memory_order_relaxed) &&
+            now() >= _inhibit_until.load(std::memory_order_relaxed)) {
+            _rbias.store(true, std::memory_order_release);
+        }
+    }
+    
+    void unlock_shared() {
+        if (_readers.present()) {
+            _readers.depart();
+            return;
+        }
+        _mutex.unlock_shared();
+    }
+    
+    void lock() {
+        _mutex.lock();
+        if (_rbias.load(std::memory_order_relaxed)) {
+            _rbias.store(false, std::memory_order_seq_cst);
+            
+            auto start = now();
+            while (!_readers.empty())
+                std::this_thread::yield();
+            _inhibit_until.store(now() + (now() - start) * inhibit_multiplier,
+                                 std::memory_order_relaxed);
+        }
+    }
+    
+    void unlock() {
+        _mutex.unlock();
+    }
+    
+private:
+    static constexpr std::int64_t inhibit_multiplier = 9;
+    
+    static std::int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    std::atomic<bool> _rbias = {true};
+    std::atomic<std::int64_t> _inhibit_until = {0};
+    read_indicator _readers;
+    std::shared_timed_mutex _mutex;
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "read_indicator.h"
+
+/*
+ Epoch based deferred reclamation for lock-free readers. A thread enters
+ before it loads any shared pointer and exits when it holds none. Memory
+ retired during epoch e is freed once the global epoch reaches e + 2:
+ by then every thread that could have seen it has exited. The epoch only
+ advances when all threads inside have caught up with it, so a stalled
+ reader delays frees but never makes them unsafe.
+*/
+class epoch_reclaimer {
+public:
+    using deleter_type = void (*)(void*);
+    
+    class guard {
+    public:
+        explicit guard(epoch_reclaimer& owner) : _owner(owner) {
+            _owner.enter();
+        }
+        
+        ~guard() {
+            _owner.exit();
+        }
+        
+        guard(const guard&) = delete;
+        guard& operator=(const guard&) = delete;
+    
+    private:
+        epoch_reclaimer& _owner;
+    };
+    
+    epoch_reclaimer() = default;
+    epoch_reclaimer(const epoch_reclaimer&) = delete;
+    epoch_reclaimer& operator=(const epoch_reclaimer&) = delete;
+    
+    // the owner must make sure no thread is inside any more
+    ~epoch_reclaimer() {
+        drain();
+    }
+    
+    // nests; only the outermost enter publishes the epoch
+    void enter() {
+        int idx = thread_slot::index();
+        if (idx < 0) {
+            _overflow.fetch_add(1, std::memory_order_seq_cst);
+            return;
+        }
+        slot& s = _slots[idx];
+        if (s.depth++ == 0)
+            s.epoch.store((_global.load(std::memory_order_seq_cst) << 1) | 1, std::memory_order_seq_cst);
+    }
+    
+    void exit() {
+        int idx = thread_slot::index();
+        if (idx < 0) {
+            _overflow.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+        slot& s = _slots[idx];
+        if (--s.depth == 0)
+            s.epoch.store(0, std::memory_order_release);
+    }
+    
+    template<typename T>
+    void retire(T* pointer) {
+        retire(pointer, [](void* p) { delete static_cast<T*>(p); });
+    }
+    
+    void retire(void* pointer, deleter_type deleter) {
+        std::vector<retired> ready;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _limbo[_global.load(std::memory_order_relaxed) % 3].push_back({pointer, deleter});
+            if (++_pending < advance_every)
+                return;
+            _pending = 0;
+            _try_advance(ready);
+        }
+        _free(ready);
+    }
+    
+    // tries to move the epoch on and frees what became safe; false if a thread lags behind
+    bool collect() {
+        std::vector<retired> ready;
+        bool advanced;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            advanced = _try_advance(ready);
+        }
+        _free(ready);
+        return advanced;
+    }
+    
+    // frees everything retired so far; no thread may be inside
+    void drain() {
+        std::vector<retired> ready;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto& bucket : _limbo) {
+                ready.insert(ready.end(), bucket.begin(), bucket.end());
+                bucket.clear();
+            }
+        }
+        _free(ready);
+    }
+    
+    size_t pending() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _limbo[0].size() + _limbo[1].size() + _limbo[2].size();
+    }
+
+private:
+    static constexpr size_t advance_every = 64;
+    
+    struct retired {
+        void* pointer;
+        deleter_type deleter;
+    };
+    
+    // epoch << 1 | 1 while the thread is inside, 0 outside
+    struct alignas(64) slot {
+        std::atomic<std::uint64_t> epoch = {0};
+        // touched by the owning thread only
+        std::uint32_t depth = 0;
+    };
+    
+    bool _try_advance(std::vector<retired>& ready) {
+        if (_overflow.load(std::memory_order_seq_cst) != 0)
+            return false;
+        
+        std::uint64_t e = _global.load(std::memory_order_relaxed);
+        for (const auto& s : _slots) {
+            std::uint64_t v = s.epoch.load(std::memory_order_seq_cst);
+            if ((v & 1) && (v >> 1) != e)
+                return false;
+        }
+        
+        _global.store(e + 1, std::memory_order_seq_cst);
+        // the bucket of epoch e - 1, which is also where e + 2 will retire to
+        ready.swap(_limbo[(e + 2) % 3]);
+        return true;
+    }
+    
+    static void _free(std::vector<retired>& ready) {
+        for (auto& r : ready)
+            r.deleter(r.pointer);
+        ready.clear();
+    }
+    
+    std::atomic<std::uint64_t> _global = {0};
+    slot _slots[thread_slot::max_threads];
+    std::atomic<size_t> _overflow = {0};
+    
+    std::mutex _mutex;
+    std::vector<retired> _limbo[3];
+    size_t _pending = 0;
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <typeinfo>
+#include <vector>
+
+/*
+ Log2 histogram of durations in nanoseconds: bucket i counts samples in
+ [2^i, 2^(i+1)), bucket 0 also takes everything below 2 ns.
+*/
+class duration_histogram {
+public:
+    static constexpr size_t buckets = 40;
+    
+    void record(std::uint64_t ns) {
+        size_t b = 0;
+        while (b + 1 < buckets && (ns >> (b + 1)) != 0)
+            b++;
+        _counts[b].fetch_add(1, std::memory_order_relaxed);
+        _total.fetch_add(ns, std::memory_order_relaxed);
+    }
+    
+    std::uint64_t count() const {
+        std::uint64_t n = 0;
+        for (const auto& c : _counts)
+            n += c.load(std::memory_order_relaxed);
+        return n;
+    }
+    
+    std::uint64_t total() const {
+        return _total.load(std::memory_order_relaxed);
+    }
+    
+    // upper bound of the bucket holding the given quantile
+    std::uint64_t quantile(double q) const {
+        std::uint64_t n = count();
+        std::uint64_t seen = 0;
+        for (size_t b = 0; b < buckets; b++) {
+            seen += _counts[b].load(std::memory_order_relaxed);
+            if (n && seen >= q * n)
+                return std::uint64_t(1) << (b + 1);
+        }
+        return 0;
+    }
+    
+    void dump(std::ostream& os) const {
+        std::uint64_t n = count();
+        os << "count " << n
+           << " mean " << (n ? total() / n : 0) << "ns"
+           << " p50 <" << quantile(0.5) << "ns"
+           << " p99 <" << quantile(0.99) << "ns";
+    }
+    
+private:
+    std::atomic<std::uint64_t> _counts[buckets] = {};
+    std::atomic<std::uint64_t> _total = {0};
+};
+
+/*
+ Wait and hold histograms of one lock class. Every class registers
+ itself on first use, dump_all prints all of them.
+*/
+class lock_stats {
+public:
+    explicit lock_stats(const char* name) : _name(name) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry().push_back(this);
+    }
+    
+    const char* name() const {
+        return _name;
+    }
+    
+    duration_histogram wait;
+    duration_histogram hold;
+    duration_histogram shared_wait;
+    duration_histogram shared_hold;
+    
+    void dump(std::ostream& os) const {
+        os << _name << "\n";
+        os << "  exclusive wait: "; wait.dump(os); os << "\n";
+        os << "  exclusive hold: "; hold.dump(os); os << "\n";
+        os << "  shared wait:    "; shared_wait.dump(os); os << "\n";
+        os << "  shared hold:    "; shared_hold.dump(os); os << "\n";
+    }
+    
+    static void dump_all(std::ostream& os) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        for (const lock_stats* stats : registry())
+            stats -> dump(os);
+    }
+    
+private:
+    const char* _name;
+    
+    static std::vector<lock_stats*>& registry() {
+        static std::vector<lock_stats*> all;
+        return all;
+    }
+    
+    static std::mutex& registry_mutex() {
+        static std::mutex mut;
+        return mut;
+    }
+};
+
+// default class tag: one statistics entry per wrapped lock type
+template<typename Lock>
+struct lock_class {
+    static const char* name() {
+        return typeid(Lock).name();
+    }
+};
+
+/*
+ Drop-in wrapper that times how long callers wait for Lock and how long
+ they hold it. Tag::name() names the lock class, so e.g. tree and list
+ locks of the same type can be told apart. Both the std lock interface
+ and the rlock/wlock/unlock spelling of RWSpinLock are provided; the
+ wrapped type needs lock/unlock and, for shared use, lock_shared/unlock_shared.
+*/
+template<typename Lock, typename Tag = lock_class<Lock>>
+class instrumented_lock {
+public:
+    static lock_stats& stats() {
+        static lock_stats s(Tag::name());
+        return s;
+    }
+    
+    void lock() {
+        auto start = now();
+        _lock.lock();
+        auto acquired = now();
+        stats().wait.record(acquired - start);
+        held().push_back({this, acquired, false});
+    }
+    
+    void lock_shared() {
+        auto start = now();
+        _lock.lock_shared();
+        auto acquired = now();
+        stats().shared_wait.record(acquired - start);
+        held().push_back({this, acquired, true});
+    }
+    
+    // ends the calling thread's latest hold of this lock, whatever its mode
+    void unlock() {
+        auto& stack = held();
+        for (size_t i = stack.size(); i-- > 0; ) {
+            if (stack[i].lock != this)
+                continue;
+            
+            hold_record rec = stack[i];
+            stack.erase(stack.begin() + i);
+            if (rec.shared) {
+                _lock.unlock_shared();
+                stats().shared_hold.record(now() - rec.since);
+            } else {
+                _lock.unlock();
+                stats().hold.record(now() - rec.since);
+            }
+            return;
+        }
+        _lock.unlock();
+    }
+    
+    void unlock_shared() {
+        unlock();
+    }
+    
+    void wlock() {
+        lock();
+    }
+    
+    void rlock() {
+        lock_shared();
+    }
+    
+private:
+    struct hold_record {
+        const instrumented_lock* lock;
+        std::uint64_t since;
+        bool shared;
+    };
+    
+    static std::vector<hold_record>& held() {
+        thread_local std::vector<hold_record> records;
+        return records;
+    }
+    
+    static std::uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    Lock _lock;
+};
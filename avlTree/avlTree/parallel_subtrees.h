@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include "thread_pool.h"
+
+/*
+ Fork-join over the top levels of a binary search tree. split() cuts the
+ tree at a small depth into pieces that follow key order: whole subtrees
+ and the single nodes above the cut between them. Each worker takes one
+ contiguous run of pieces, so results joined run by run come out in key
+ order. Subtrees of an AVL tree at one depth differ in size by a small
+ factor only, a few pieces per worker keep the load even. The runs go to
+ the shared thread_pool.
+ 
+ Nodes need _left and _right links with peek(). Nothing here locks, the
+ caller keeps the tree from changing shape while the workers run.
+*/
+namespace parallel_subtrees {
+    
+    template<typename node>
+    struct piece
+    {
+        node* root;
+        // false for a node above the cut, which is visited alone
+        bool whole;
+    };
+    
+    template<typename node>
+    void split(node* n, int depth, std::vector<piece<node>>& out)
+    {
+        if (!n)
+            return;
+        if (depth == 0) {
+            out.push_back({n, true});
+            return;
+        }
+        split(n -> _left.peek(), depth - 1, out);
+        out.push_back({n, false});
+        split(n -> _right.peek(), depth - 1, out);
+    }
+    
+    // in order and without recursion
+    template<typename node, typename Func>
+    void visit(const piece<node>& p, Func& f)
+    {
+        if (!p.whole) {
+            f(p.root);
+            return;
+        }
+        std::vector<node*> stack;
+        node* n = p.root;
+        while (n || !stack.empty()) {
+            while (n) {
+                stack.push_back(n);
+                n = n -> _left.peek();
+            }
+            n = stack.back();
+            stack.pop_back();
+            f(n);
+            n = n -> _right.peek();
+        }
+    }
+    
+    // cut deep enough for about four pieces per worker
+    template<typename node>
+    std::vector<piece<node>> pieces(node* root, unsigned workers)
+    {
+        int depth = 0;
+        while ((size_t(1) << depth) < 4 * size_t(workers))
+            depth++;
+        std::vector<piece<node>> out;
+        split(root, depth, out);
+        return out;
+    }
+    
+    // f(node*) for every node, called from up to workers threads at once
+    template<typename node, typename Func>
+    void for_each(node* root, unsigned workers, Func f)
+    {
+        std::vector<piece<node>> parts = pieces(root, std::max(workers, 1u));
+        if (parts.empty())
+            return;
+        size_t count = std::min<size_t>(std::max(workers, 1u), parts.size());
+        thread_pool::shared().parallel_for(count, [&](size_t t) {
+            for (size_t i = t * parts.size() / count; i < (t + 1) * parts.size() / count; i++)
+                visit(parts[i], f);
+        });
+    }
+    
+    /*
+     Joins map(node*) of every node with combine, which must be
+     associative. Shares are joined in key order and init is joined in
+     once, in front, as with std::reduce.
+    */
+    template<typename T, typename node, typename Map, typename Combine>
+    T reduce(node* root, unsigned workers, T init, Map map, Combine combine)
+    {
+        std::vector<piece<node>> parts = pieces(root, std::max(workers, 1u));
+        if (parts.empty())
+            return init;
+        size_t count = std::min<size_t>(std::max(workers, 1u), parts.size());
+        std::vector<T> partial(count, init);
+        std::vector<char> filled(count, 0);
+        thread_pool::shared().parallel_for(count, [&](size_t t) {
+            auto add = [&](node* n) {
+                partial[t] = filled[t] ? combine(partial[t], map(n)) : map(n);
+                filled[t] = 1;
+            };
+            for (size_t i = t * parts.size() / count; i < (t + 1) * parts.size() / count; i++)
+                visit(parts[i], add);
+        });
+        
+        T res = init;
+        for (size_t t = 0; t < count; t++) {
+            if (filled[t])
+                res = combine(res, partial[t]);
+        }
+        return res;
+    }
+}
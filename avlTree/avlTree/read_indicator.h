@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ Small per-thread index used to give every live thread its own slot in
+ the per-lock reader arrays. Indexes are recycled when a thread exits;
+ threads beyond max_threads get no slot and take the slow paths.
+*/
+class thread_slot {
+public:
+    static constexpr size_t max_threads = 64;
+    
+    static int index() {
+        thread_local holder h;
+        return h.idx;
+    }
+    
+private:
+    struct holder {
+        int idx = -1;
+        
+        holder() {
+            for (size_t i = 0; i < max_threads; i++) {
+                bool expected = false;
+                if (used()[i].compare_exchange_strong(expected, true)) {
+                    idx = static_cast<int>(i);
+                    break;
+                }
+            }
+        }
+        
+        ~holder() {
+            if (idx >= 0)
+                used()[idx] = false;
+        }
+    };
+    
+    static std::atomic<bool>* used() {
+        static std::atomic<bool> flags[max_threads] = {};
+        return flags;
+    }
+};
+
+/*
+ Reader presence counters, one cache line per thread slot. Readers only
+ ever write to their own line, so arriving and departing do not bounce
+ a shared counter between cores. empty() is the writer side and scans
+ every slot.
+*/
+class read_indicator {
+public:
+    // false when the calling thread has no slot; nothing is recorded then
+    bool arrive() {
+        int idx = thread_slot::index();
+        if (idx < 0)
+            return false;
+        _slots[idx].count.fetch_add(1, std::memory_order_seq_cst);
+        return true;
+    }
+    
+    void depart() {
+        _slots[thread_slot::index()].count.fetch_sub(1, std::memory_order_release);
+    }
+    
+    // the calling thread is currently counted in its slot
+    bool present() const {
+        int idx = thread_slot::index();
+        return idx >= 0 && _slots[idx].count.load(std::memory_order_relaxed) != 0;
+    }
+    
+    bool empty() const {
+        for (const auto& slot : _slots) {
+            if (slot.count.load(std::memory_order_seq_cst) != 0)
+                return false;
+        }
+        return true;
+    }
+    
+private:
+    struct alignas(64) slot {
+        std::atomic<std::uint32_t> count = {0};
+    };
+    
+    slot _slots[thread_slot::max_threads];
+};
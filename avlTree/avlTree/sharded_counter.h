@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "read_indicator.h"
+
+/*
+ Element counter split into one cache line per thread slot. A thread
+ only writes its own line, so updates from different cores never touch
+ the same line. sum() adds up every line and is exact once writers are
+ quiet. approx() reads one shared total that each slot pushes its local
+ delta into every flush_every updates, so it is off by at most
+ flush_every per slot. Threads without a slot share one atomic.
+*/
+class sharded_counter {
+public:
+    static constexpr std::int64_t flush_every = 64;
+    
+    void add(std::int64_t delta) {
+        int idx = thread_slot::index();
+        if (idx < 0) {
+            _overflow.fetch_add(delta, std::memory_order_relaxed);
+            _approx.fetch_add(delta, std::memory_order_relaxed);
+            return;
+        }
+        slot& s = _slots[idx];
+        // a slot has one owner at a time, so a plain load and store will do
+        s.value.store(s.value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+        std::int64_t pending = s.unflushed.load(std::memory_order_relaxed) + delta;
+        if (pending >= flush_every || pending <= -flush_every) {
+            _approx.fetch_add(pending, std::memory_order_relaxed);
+            pending = 0;
+        }
+        s.unflushed.store(pending, std::memory_order_relaxed);
+    }
+    
+    void increment() {
+        add(1);
+    }
+    
+    void decrement() {
+        add(-1);
+    }
+    
+    size_t sum() const {
+        std::int64_t total = _overflow.load(std::memory_order_relaxed);
+        for (const auto& s : _slots)
+            total += s.value.load(std::memory_order_relaxed);
+        // an insert counted on one slot may be seen after its removal on another
+        return total > 0 ? static_cast<size_t>(total) : 0;
+    }
+    
+    size_t approx() const {
+        std::int64_t total = _approx.load(std::memory_order_relaxed);
+        return total > 0 ? static_cast<size_t>(total) : 0;
+    }
+    
+    // not safe against concurrent updates
+    void reset() {
+        for (auto& s : _slots) {
+            s.value.store(0, std::memory_order_relaxed);
+            s.unflushed.store(0, std::memory_order_relaxed);
+        }
+        _overflow.store(0, std::memory_order_relaxed);
+        _approx.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(64) slot {
+        std::atomic<std::int64_t> value = {0};
+        std::atomic<std::int64_t> unflushed = {0};
+    };
+    
+    slot _slots[thread_slot::max_threads];
+    alignas(64) std::atomic<std::int64_t> _overflow = {0};
+    alignas(64) std::atomic<std::int64_t> _approx = {0};
+};
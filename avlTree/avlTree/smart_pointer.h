@@ -36,8 +36,9 @@ public:
         std::shared_lock<shared_timed_mutex> lock (mut);
         std::shared_lock<shared_timed_mutex> lock2 (sp.mut);
         
-        core = sp.core;
-        if (core) core -> owners++;
+        Core* c = sp.core.load(std::memory_order_relaxed);
+        if (c) c -> owners++;
+        core.store(c, std::memory_order_release);
     }
     
     /*
@@ -45,8 +46,8 @@ public:
     */
     SmartPointer(SmartPointer&& sp) {
         std::unique_lock<shared_timed_mutex> lock(mut);
-        core = sp.core;
-        sp.core = nullptr;
+        core.store(sp.core.load(std::memory_order_relaxed), std::memory_order_release);
+        sp.core.store(nullptr, std::memory_order_release);
     }
     
     // copy assigment
@@ -54,124 +55,121 @@ public:
         std::shared_lock<shared_timed_mutex> lock1 (mut);
         std::shared_lock<shared_timed_mutex> lock2 (sp.mut);
         
-        if (core != nullptr) {
-            core -> owners--;
-            if (core -> owners == 0) {
-                delete core -> pointer;
-                delete core;
-            }
-        }
-        core = sp.core;
-        if (core)
-            core -> owners++;
+        // take the new reference first, so self-assignment never frees the core
+        Core* old = core.load(std::memory_order_relaxed);
+        Core* c = sp.core.load(std::memory_order_relaxed);
+        if (c)
+            c -> owners++;
+        core.store(c, std::memory_order_release);
         
+        _release(old);
         return *this;
     }
     
     // move assigment
     SmartPointer &operator=(SmartPointer&& sp) {
         std::unique_lock<shared_timed_mutex> lock(mut);
-        if (core != nullptr) {
-            core -> owners--;
-            if (core -> owners == 0) {
-                delete core -> pointer;
-                delete core;
-            }
-        }
-        core = sp.core;
-        sp.core = nullptr;
+        Core* old = core.load(std::memory_order_relaxed);
+        core.store(sp.core.load(std::memory_order_relaxed), std::memory_order_release);
+        sp.core.store(nullptr, std::memory_order_release);
+        _release(old);
         return *this;
     }
     
     SmartPointer &operator=(value_type* sp) {
         std::unique_lock<shared_timed_mutex> lock(mut);
-        if (core != nullptr) {
-            core -> owners--;
-            if (core -> owners == 0) {
-                delete core -> pointer;
-                delete core;
-            }
-        }
-        if (sp == nullptr) {
-            core = nullptr;
-            return *this;
-        }
-        
-        core = new Core(sp, 1);
+        Core* old = core.load(std::memory_order_relaxed);
+        core.store(sp == nullptr ? nullptr : new Core(sp, 1), std::memory_order_release);
+        _release(old);
         return *this;
     }
     
     ~SmartPointer() {
         std::unique_lock<shared_timed_mutex> lock(mut);
-        if (core != nullptr) {
-            core -> owners--;
-            if (core -> owners == 0) {
-                delete core -> pointer;
-                delete core;
-            }
-        }
+        _release(core.load(std::memory_order_relaxed));
     }
 
     value_type& operator*() {
         std::shared_lock<shared_timed_mutex> lock (mut);
-        if (!core) throw smart_pointer::exception();
-        return *(core->ptr);
+        Core* c = core.load(std::memory_order_relaxed);
+        if (!c) throw smart_pointer::exception();
+        return *(c->pointer);
     }
     
     const value_type &operator*() const {
         std::shared_lock<shared_timed_mutex> lock (mut);
-        if (!core) throw smart_pointer::exception();
-        return *(core->ptr);
+        Core* c = core.load(std::memory_order_relaxed);
+        if (!c) throw smart_pointer::exception();
+        return *(c->pointer);
     }
     
     value_type *operator->() {
-        std::shared_lock<shared_timed_mutex> lock(mut);
-        return core ? core->pointer : nullptr;
+        return get();
     }
     
     
     value_type *operator->() const {
-        std::shared_lock<shared_timed_mutex> lock(mut);
-        return core ? core->pointer : nullptr;
+        return get();
     }
     
     
     value_type *get() const {
         std::shared_lock<shared_timed_mutex> lock(mut);
-        return core ? core->pointer : nullptr;
+        Core* c = core.load(std::memory_order_relaxed);
+        return c ? c->pointer : nullptr;
+    }
+    
+    /*
+     Raw pointer read without taking mut. The core is published with a
+     release store, so a reader racing a writer sees either the old or
+     the new node whole; the caller validates which one it got.
+    */
+    value_type *peek() const {
+        Core* c = core.load(std::memory_order_acquire);
+        return c ? c->pointer : nullptr;
     }
     
     // if pointer == nullptr => return false
     operator bool() const {
         std::shared_lock<shared_timed_mutex> lock(mut);
-        return core != nullptr;
+        return core.load(std::memory_order_relaxed) != nullptr;
     }
     
     // if pointers points to the same address or both null => true
     template<typename U>
     bool operator==(const SmartPointer<U> &sp) const {
-        return (!core && sp.get() == nullptr) ||
-        (static_cast<void*>(get()) == static_cast<void *>(sp.get()));
+        return static_cast<void*>(get()) == static_cast<void *>(sp.get());
     }
     
     // if pointers points to the same address or both null => false
     template<typename U>
     bool operator!=(const SmartPointer<U> &sp) const {
-        return !((!core && sp.get() == nullptr) ||
-                 (static_cast<void*>(get()) == static_cast<void*>(sp.get())));
+        return !(*this == sp);
     }
     
-    std::size_t count_owners() const { return core ? core->owners : 0; }
+    std::size_t count_owners() const {
+        Core* c = core.load(std::memory_order_relaxed);
+        return c ? c->owners.load() : 0;
+    }
     
 private:
     class Core {
     public:
-        Core(value_type *sp, size_t count) : pointer(sp), owners(count) {}
+        Core(value_type *sp, size_t count) : owners(count), pointer(sp) {}
         std::atomic<size_t> owners = {0};
         value_type *pointer;
 
     };
-    Core *core;
+    
+    static void _release(Core* c) {
+        if (c != nullptr && --c -> owners == 0) {
+            delete c -> pointer;
+            delete c;
+        }
+    }
+    
+    // atomic because optimistic readers peek() links that writers reassign
+    std::atomic<Core*> core;
     mutable std::shared_timed_mutex mut;
 };
 }
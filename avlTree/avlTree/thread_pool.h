@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+ Work-stealing thread pool. Every worker owns a deque: it pushes and pops
+ its own tasks at the back, so nested forks run depth first on a warm
+ cache, and an idle worker steals from the front of the others, where
+ the oldest and usually biggest pieces of work wait. Tasks submitted from
+ outside go to the workers round robin. A thread that waits for forked
+ tasks runs queued ones meanwhile, so fork/join nests inside tasks
+ without tying up workers.
+ 
+ shared() is the pool the containers use for their parallel operations
+ and background work, one worker per hardware thread.
+*/
+class thread_pool {
+public:
+    using task = std::function<void()>;
+    
+    /*
+     Tasks forked into a group may run on any thread of the pool; join()
+     returns once all of them have finished and runs queued tasks while
+     it waits. If tasks threw, join() rethrows the first exception once
+     the rest have finished. The destructor waits the same way but drops
+     the exception.
+    */
+    class task_group {
+    public:
+        explicit task_group(thread_pool& pool = shared()) : _pool(pool) {}
+        
+        task_group(const task_group&) = delete;
+        task_group& operator=(const task_group&) = delete;
+        
+        ~task_group() {
+            _wait();
+        }
+        
+        template<typename Func>
+        void fork(Func f) {
+            _pending.fetch_add(1, std::memory_order_relaxed);
+            _pool.submit([this, f]() mutable {
+                try {
+                    f();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(_error_mutex);
+                    if (!_error)
+                        _error = std::current_exception();
+                }
+                // the group may be gone as soon as this drops to zero
+                _pending.fetch_sub(1, std::memory_order_release);
+            });
+        }
+        
+        void join() {
+            _wait();
+            if (_error) {
+                std::exception_ptr error = std::move(_error);
+                _error = nullptr;
+                std::rethrow_exception(error);
+            }
+        }
+    
+    private:
+        void _wait() {
+            while (_pending.load(std::memory_order_acquire) != 0) {
+                if (!_pool.run_one())
+                    std::this_thread::yield();
+            }
+        }
+        
+        thread_pool& _pool;
+        std::atomic<size_t> _pending = {0};
+        // the first exception a forked task threw
+        std::exception_ptr _error;
+        std::mutex _error_mutex;
+    };
+    
+    explicit thread_pool(unsigned workers = std::thread::hardware_concurrency())
+    : _queues(std::max(workers, 1u)) {
+        for (size_t i = 0; i < _queues.size(); i++)
+            _workers.emplace_back(&thread_pool::_work, this, i);
+    }
+    
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+    
+    // runs everything still queued, then stops the workers
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(_sleep_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (auto& w : _workers)
+            w.join();
+    }
+    
+    static thread_pool& shared() {
+        static thread_pool pool;
+        return pool;
+    }
+    
+    size_t size() const {
+        return _queues.size();
+    }
+    
+    void submit(task t) {
+        int own = _own_queue();
+        size_t idx = own >= 0 ? static_cast<size_t>(own)
+            : _next.fetch_add(1, std::memory_order_relaxed) % _queues.size();
+        {
+            std::lock_guard<std::mutex> lock(_queues[idx].mutex);
+            _queues[idx].tasks.push_back(std::move(t));
+        }
+        _queued.fetch_add(1, std::memory_order_seq_cst);
+        // pairs with the sleeper count going up before _queued is checked
+        if (_sleepers.load(std::memory_order_seq_cst) != 0) {
+            std::lock_guard<std::mutex> lock(_sleep_mutex);
+            _wake.notify_one();
+        }
+    }
+    
+    /*
+     Runs one queued task on the calling thread, false if there was none.
+     A submitted task has no one to report to, so what it throws is
+     dropped here; fork it into a task_group to see the exception.
+    */
+    bool run_one() {
+        task t;
+        if (!_take(t))
+            return false;
+        try {
+            t();
+        } catch (...) {
+        }
+        return true;
+    }
+    
+    // runs job(i) for every i below count, job(0) on the calling thread
+    template<typename Job>
+    void parallel_for(size_t count, Job job) {
+        task_group group(*this);
+        for (size_t i = 1; i < count; i++)
+            group.fork([&job, i] { job(i); });
+        if (count > 0)
+            job(0);
+        group.join();
+    }
+
+private:
+    struct alignas(64) queue {
+        std::mutex mutex;
+        std::deque<task> tasks;
+    };
+    
+    struct worker_id {
+        const thread_pool* pool;
+        size_t index;
+    };
+    
+    static worker_id& _current() {
+        thread_local worker_id id = {nullptr, 0};
+        return id;
+    }
+    
+    // the calling thread's own queue, -1 for a thread of another pool or none
+    int _own_queue() const {
+        const worker_id& id = _current();
+        return id.pool == this ? static_cast<int>(id.index) : -1;
+    }
+    
+    // the own queue from the back first, then the others from the front
+    bool _take(task& t) {
+        if (_queued.load(std::memory_order_acquire) == 0)
+            return false;
+        int own = _own_queue();
+        if (own >= 0) {
+            queue& q = _queues[own];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                t = std::move(q.tasks.back());
+                q.tasks.pop_back();
+                _queued.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        size_t start = own >= 0 ? static_cast<size_t>(own) + 1 : _next.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < _queues.size(); i++) {
+            queue& q = _queues[(start + i) % _queues.size()];
+            std::unique_lock<std::mutex> lock(q.mutex, std::try_to_lock);
+            if (!lock.owns_lock() || q.tasks.empty())
+                continue;
+            t = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            _queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+    
+    void _work(size_t index) {
+        _current() = {this, index};
+        while (true) {
+            if (run_one())
+                continue;
+            
+            std::unique_lock<std::mutex> lock(_sleep_mutex);
+            if (_stop && _queued.load(std::memory_order_seq_cst) == 0)
+                return;
+            _sleepers.fetch_add(1, std::memory_order_seq_cst);
+            _wake.wait(lock, [this] { return _stop || _queued.load(std::memory_order_seq_cst) != 0; });
+            _sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    
+    std::vector<queue> _queues;
+    std::vector<std::thread> _workers;
+    std::atomic<size_t> _next = {0};
+    // tasks sitting in some queue
+    std::atomic<size_t> _queued = {0};
+    std::atomic<size_t> _sleepers = {0};
+    bool _stop = false;
+    std::mutex _sleep_mutex;
+    std::condition_variable _wake;
+};
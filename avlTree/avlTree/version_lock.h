@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+/*
+ Reader-writer spin lock in one 64-bit word that also counts exclusive
+ sections, so it can back optimistic reads. The low 15 bits count
+ readers, bit 15 is the writer, the high 48 bits are the version, bumped
+ by every exclusive unlock. A waiting writer keeps new readers out, and
+ so does a full reader count, which would otherwise carry into the
+ writer bit.
+ Waiting spins a bounded number of times and then yields, so a preempted
+ holder costs a time slice rather than a core.
+*/
+class version_lock {
+public:
+    void lock() {
+        std::uint64_t old = _word.load(std::memory_order_relaxed);
+        for (int spins = 0; ; spins++) {
+            if (!(old & writer_bit) &&
+                _word.compare_exchange_weak(old, old | writer_bit, std::memory_order_acquire))
+                break;
+            _backoff(spins);
+            old = _word.load(std::memory_order_relaxed);
+        }
+        for (int spins = 0; _word.load(std::memory_order_acquire) & reader_mask; spins++)
+            _backoff(spins);
+    }
+    
+    bool try_lock() {
+        std::uint64_t old = _word.load(std::memory_order_relaxed);
+        return !(old & (writer_bit | reader_mask)) &&
+            _word.compare_exchange_strong(old, old | writer_bit, std::memory_order_acquire);
+    }
+    
+    void unlock() {
+        // clears the writer bit and moves the version on in one add
+        _word.fetch_add(version_one - writer_bit, std::memory_order_release);
+    }
+    
+    void lock_shared() {
+        std::uint64_t old = _word.load(std::memory_order_relaxed);
+        for (int spins = 0; ; spins++) {
+            if (!(old & writer_bit) && (old & reader_mask) != reader_mask &&
+                _word.compare_exchange_weak(old, old + 1, std::memory_order_acquire))
+                break;
+            _backoff(spins);
+            old = _word.load(std::memory_order_relaxed);
+        }
+    }
+    
+    bool try_lock_shared() {
+        std::uint64_t old = _word.load(std::memory_order_relaxed);
+        return !(old & writer_bit) && (old & reader_mask) != reader_mask &&
+            _word.compare_exchange_strong(old, old + 1, std::memory_order_acquire);
+    }
+    
+    void unlock_shared() {
+        _word.fetch_sub(1, std::memory_order_release);
+    }
+    
+    // names of RWSpinLock, so the two are interchangeable
+    void wlock() {
+        lock();
+    }
+    
+    void rlock() {
+        lock_shared();
+    }
+    
+    /*
+     Optimistic reads: take a stamp, read without the lock, and trust the
+     reads only if validate(stamp) holds afterwards. The stamp waits out a
+     writer that is inside. 48 bits of version take centuries of writes to
+     wrap, so a stamp cannot match again after its section was changed.
+    */
+    std::uint64_t read_stamp() const {
+        std::uint64_t v = _word.load(std::memory_order_acquire);
+        for (int spins = 0; v & writer_bit; spins++) {
+            _backoff(spins);
+            v = _word.load(std::memory_order_acquire);
+        }
+        return v >> version_shift;
+    }
+    
+    bool validate(std::uint64_t stamp) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        std::uint64_t v = _word.load(std::memory_order_relaxed);
+        return !(v & writer_bit) && (v >> version_shift) == stamp;
+    }
+
+private:
+    static constexpr std::uint64_t reader_mask = (1u << 15) - 1;
+    static constexpr std::uint64_t writer_bit = 1u << 15;
+    static constexpr int version_shift = 16;
+    static constexpr std::uint64_t version_one = std::uint64_t(1) << version_shift;
+    static constexpr int spin_limit = 100;
+    
+    static void _backoff(int spins) {
+        if (spins >= spin_limit)
+            std::this_thread::yield();
+    }
+    
+    std::atomic<std::uint64_t> _word = {0};
+};